@@ -1,7 +1,9 @@
 /*
 DESIGN CONSIDERATION:
 --------------------
-- Since a keyboard layout is a matrix, a 2D vector is used to represent the layout.
+- Since a keyboard layout is a matrix, a 2D vector is used to describe the layout. It is
+  stored as one contiguous row-major buffer of KeyCodes, so large layouts (100x100 and
+  beyond) cost a single allocation and keys are not limited to the values of a char.
 
 - Dependency Injection has been applied so that this code could be reusable if a different
   chess-piece, sequence length, number of vowels allowed, choice of invalid key and/or 
@@ -9,8 +11,84 @@ DESIGN CONSIDERATION:
   
 - The valid moves for all the key positions have been calculated beforehand. This enhances 
   the performance multifold since it no longer checks all possible chess-piece moves for each 
-  key position during the BFS.
+  key position during the BFS. They are stored in a flat, index-based (CSR) table: the valid
+  keys get dense indices, their moves sit back to back in one array with the vowel flag of
+  the destination stored inline, so the traversals need no hashing or per-step allocation.
   
+- When only the total is needed, the sequences are counted with dynamic programming over
+  (key, vowels used) states, one level at a time, instead of being materialized. This keeps
+  the memory at O(N * maxVowelCount) for any sequence length. The BFS enumeration is still
+  available through CountingMode::Enumerate.
+
+- For very long sequences the same recurrence is evaluated as a transition matrix raised
+  to the power (sequenceLength - 1) by repeated squaring (CountingMode::MatrixPower), which
+  costs O(S^3 * log(sequenceLength)) for S = N * (maxVowelCount + 1) states.
+
+- Layouts of at most 64 cells are also represented as bitboards, as in chess engines: the
+  layout exposes an occupancy mask and the chess-piece precomputed attack bitboards per cell,
+  so the bitboard counting engine (CountingMode::Bitboard) expands the frontier of all the
+  start keys at once with shifts and masks.
+
+- Each level of the DP is a sparse matrix-vector product over the incoming moves of every
+  key. For uint64_t counts the per-key count vector is padded to whole SIMD registers and the
+  step kernel adds the vectors of all the sources with AVX2/NEON instructions when compiled
+  for them (e.g. -mavx2), with a scalar fallback otherwise.
+
+- Past SPARSE_STATE_THRESHOLD (key, vowels used) states, DynamicProgramming runs on the
+  sparse engine (CountingMode::SparseMatrix) instead: the keys are renumbered tile by tile
+  so the sources of a key stay close in memory, and every level is split over the threads
+  into key ranges with about the same number of moves. The dense matrix power is O(S^3) and
+  is left to small layouts and very long sequences.
+
+- When the sequences themselves are needed, the BFS of every start key is independent, so
+  CountingMode::ParallelEnumerate spreads the start keys over a configurable number of threads
+  and merges the per-key results at the end. Since corner keys have far fewer moves than
+  central ones, CountingMode::WorkStealingEnumerate instead splits the search into prefix tasks
+  of a configurable depth and runs them on per-thread deques with work stealing.
+
+- The counting engines are templated on the count type so that callers pay only for the
+  range they need: uint64_t, Count128 (unsigned __int128), ModularCount<> (modulo a prime)
+  or BigCount (arbitrary precision).
+
+- The vowel flag of every key is resolved once, through a pluggable per-key predicate (a
+  compile-time lookup table by default), and the traversals carry the vowel count of every
+  partial sequence instead of rescanning it, so the vowel pruning is O(1) per step.
+
+- Sequences can be streamed to a SequenceSink (stdout, file, counting, per-key map) as they are
+  produced by Keyboard::EnumerateSequences(), so only the traversal frontier is held in memory.
+
+- Chess-pieces known at compile time derive from StaticChessPiece<Piece> and provide constexpr
+  move offsets; the Keyboard then builds its move table without virtual calls, with the move
+  set inlined. Pieces defined at runtime keep using the virtual ChessPiece interface.
+
+- For layouts and parameters fixed at compile time CountSequencesAtCompileTime() evaluates the
+  same recurrence in a constexpr context, e.g. DEFAULT_SEQUENCE_COUNT for the shipped layout.
+
+- Per-start-key and per-end-key totals, and optionally the full start x end matrix, are
+  produced straight from the DP by Keyboard::GetSequenceBreakdown(), the per-start totals by
+  running the DP over the reversed move graph.
+
+- Many (sequence length, vowel limit) queries against one layout and chess-piece are answered
+  by SequenceQueryEngine with a single DP sweep up to the longest requested length.
+
+- Repeated queries can go through a SequenceCountCache: a thread-safe LRU cache keyed by a
+  stable hash of the layout, the chess-piece name and the parameters, which can be saved to
+  and loaded from disk.
+
+- Besides the Knight, King, Bishop, Rook and Queen are provided. The sliding pieces stop at the
+  edges and at invalid keys, and their full reachable sets are precomputed once into the move
+  table, so they run on the same counting engines despite their larger branching factor.
+
+- Running with --benchmark times every engine over a sweep of sequence lengths, vowel limits,
+  layout sizes and thread counts (KeyboardBenchmark), checking each run against the DP count
+  and reporting ns/run, ns/sequence, the peak RSS of each case and, when built with
+  -DCHESS_CHALLENGE_COUNT_ALLOCATIONS, heap allocations per run.
+
+- Built with -DCHESS_CHALLENGE_STATS, the enumerators count the nodes expanded, the moves
+  pruned by the vowel limit and the BFS queue high-water mark, and every run records its
+  precompute and traversal time and the bytes allocated (TraversalStats, also printed as JSON
+  or Prometheus text with --stats). Without it the instrumentation compiles to nothing.
+
 - Usage of Recursive approach has been consciously avoided to prevent risk of stack overflow.
 
 - Breadth-first search (BFS) approach was adopted to enhance performance:
@@ -30,6 +108,58 @@ DESIGN CONSIDERATION:
       at the current level in the queue. In contrast, DFS can potentially require more memory due to recursion stack 
       space, especially for deep search trees.
 
+- The BFS keeps no string per partial sequence: every level is an arena of (parent, key,
+  vowels) nodes, so the extensions of a prefix share it, and a finished sequence is spelled
+  into one reused buffer. KeySequences hold PackedSequences, the sequences of a start key
+  back to back in a single block of sequenceLength bytes each, instead of one string each.
+
+- Enumerated sequences can be archived with PackedSequenceFileSink: a header with the layout,
+  chess-piece and parameters, then every key as its alphabet index on ceil(log2(N)) bits (5 for
+  the shipped layout). PackedSequenceFile memory-maps such a file and decodes any sequence
+  straight from the bit stream.
+
+- Keyboard::Rank() and Keyboard::Unrank() map valid sequences to and from their index in the
+  depth-first enumeration order through a table of completion counts per remaining length and
+  (key, vowels used) state (SequenceRanker), in O(sequence length * moves per key), so huge
+  sequence spaces can be sampled uniformly or split by index range. The counts saturate at
+  UINT64_MAX (SaturatingCount), which keeps every 64-bit rank exact on longer sequences.
+
+- The ranked sequence space can be split into contiguous shards of ranks, each enumerated on
+  its own from a spec such as --shard 3/8: the DFS resumes from the unranked first sequence of
+  the shard, so shards need no coordination and their outputs concatenate in shard order.
+
+- The grid symmetries (mirrors, half turn, and for square grids quarter turns and diagonal
+  mirrors) that map the move graph onto itself and keep every vowel flag are detected
+  (KeySymmetry). Once the DP is large enough to pay for the detection, the DP and the sparse
+  engine run over one state per orbit of keys weighted by the orbit size,
+  and EnumerateSequencesBySymmetry() searches from one start key per orbit and maps its
+  sequences onto the others. The shipped layout gets no reduction: its left-right mirror
+  swaps the vowel I with G and the vowel O with K.
+
+- Pinned point queries, e.g. the sequences from key X to key Y, go through
+  SequenceQueryEngine::CountSequences(PinnedSequenceQuery): a forward DP up to the middle
+  position and a backward DP over the reversed move graph down to it are joined on the middle
+  key and vowel budget, with the keys pinned at any position enforced along the way.
+
+- Sweeps over many layouts batch their DP in a BatchedSequenceCounter (CountingMode::Offload
+  for one layout): the incoming moves of all the layouts form one CSR matrix, and with
+  -fopenmp -DCHESS_CHALLENGE_OFFLOAD every level runs on the offload device through OpenMP
+  target regions, the tables mapped once, with the host as the fallback.
+
+- `--serve` runs a SequenceServer answering count, unrank and breakdown queries over a stdin
+  line protocol, with the move tables of every preloaded layout and piece built once and shared
+  read-only by a fixed pool of workers, the answers written back in request order.
+
+- Layouts can be edited in place (KeyboardLayout::SetKey(), MarkInvalid()), which records an
+  edit log. A Keyboard catches up on its next query by recomputing only the moves of the
+  edited cells and of the cells the chess-piece reaches them from, and drops only the caches
+  derived from the move table; SequenceCountCache entries are keyed by the layout hash, so
+  those of the other layouts, e.g. the one before an undone edit, stay valid.
+
+- An iterative depth-first enumerator (CountingMode::DepthFirst) is provided as well. It uses an
+  explicit stack, i.e. a single buffer of sequenceLength keys and one cursor into the valid moves
+  per depth, so it needs only O(sequenceLength) memory while still avoiding recursion.
+
 ASSUMPTION:
 ----------
 - The last row has two blank places the first and the last column. To specify
@@ -65,7 +195,44 @@ Total number of sequences: 1013398
 #include <unordered_map>
 #include <queue>
 #include <string>
+#include <string_view>
+#include <fstream>
 #include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <array>
+#include <list>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <new>
+#include <future>
+#include <condition_variable>
+#include <cstdlib>
+#include <cctype>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using std::cout;
 using std::cerr;
@@ -80,337 +247,5776 @@ using std::exception;
 
 using CharVector2D = vector<vector<char>>;
 using Coordinates = pair<int, int>;
-using ValidKeyMoves = unordered_map<char, vector<Coordinates>>;
-using KeySequences = unordered_map<char, vector<string>>;
+/* Identifier of a key; chars are stored as their unsigned value */
+using KeyCode = uint32_t;
+/* The traversal statistics report the bytes allocated, so they need the counting operator new */
+#if defined(CHESS_CHALLENGE_STATS) && !defined(CHESS_CHALLENGE_COUNT_ALLOCATIONS)
+#define CHESS_CHALLENGE_COUNT_ALLOCATIONS
+#endif
 
+#if defined(CHESS_CHALLENGE_COUNT_ALLOCATIONS)
 /*
-Creating a base abstract class/interface ChessPiece from which
-different child classes could be derived, e.g. Knight, Bishop, Rook.
-Since these are specific chess-pieces they would have their own 
-specific move coordinates and valid/invalid moves.
-*/ 
-class ChessPiece
-{
-public:
-    virtual vector<Coordinates> GetMoves() const = 0;
-    virtual bool IsValidMove(const int &x, const int &y, const int &moveX, const int &moveY, const char &invalidKey, const CharVector2D& layout) const = 0;
-};
-
+Number of heap allocations made by the program and their total size,
+counted by replacing the global operator new. Only compiled in for the
+benchmarks and statistics, as it adds atomic increments to every
+allocation.
+*/
+std::atomic<uint64_t> allocationCount(0);
+std::atomic<uint64_t> allocatedBytes(0);
 
-/*
-Derived a Knight class from the ChessPiece abstract class/interface
-specific to this challenge and overriding the base class (interface) 
-pure virtual functions specific to Knight moves.
-*/ 
-class Knight : public ChessPiece 
+void* operator new(size_t size)
 {
-public:
-    /* Get the possible moves for a Knight. */
-    vector<Coordinates> GetMoves() const override 
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1))
     {
-        return {{-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1}};
+        return ptr;
     }
 
-    /* Check if it's valid move. */
-    bool IsValidMove(const int &x, const int &y, const int &moveX, const int &moveY, const char &invalidKey, const CharVector2D& layout) const override
-    {
-        int ROWS = layout.size();
-        int COLS = layout[0].size();
-        int newX = x + moveX;
-        int newY = y + moveY;
-        
-        /* 
-        Check if new position is within the bounds of the keyboard 
-        layout and if it's not a null character (empty cell)
-        */
-        return (newX >= 0) && (newX < ROWS) &&
-               (newY >= 0) && (newY < COLS) &&
-               /* Checks if the new move ends up on an invalid key */
-               (layout[newX][newY] != invalidKey) &&
-               /*
-               The Knight moves in L shaped motion horizontally and 
-               vertically, and in forward a backward direction.
-               */ 
-               (((1 == abs(moveX)) && (2 == abs(moveY))) ||
-                ((2 == abs(moveX)) && (1 == abs(moveY))));
-    }
+    throw std::bad_alloc();
+}
+
+/* GCC cannot tell that the replaced operator new allocated with malloc */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+/*
+Wraps a statement of the traversal instrumentation, which is compiled in
+with -DCHESS_CHALLENGE_STATS and compiles to nothing otherwise.
+*/
+#if defined(CHESS_CHALLENGE_STATS)
+#define CHESS_CHALLENGE_STAT(statement) statement
+#else
+#define CHESS_CHALLENGE_STAT(statement)
+#endif
+
+/*
+Opens an OpenMP target region for the following loop, which runs on the
+offload device when built with -fopenmp -DCHESS_CHALLENGE_OFFLOAD (and
+falls back to the host when no device is available), and is a plain loop
+otherwise.
+*/
+#if defined(CHESS_CHALLENGE_OFFLOAD) && defined(_OPENMP)
+#define CHESS_CHALLENGE_OFFLOAD_PRAGMA(clauses) _Pragma(clauses)
+#else
+#define CHESS_CHALLENGE_OFFLOAD_PRAGMA(clauses)
+#endif
+
+template<typename CountType>
+using CountMatrix = vector<vector<CountType>>;
+
+/*
+Selects how the Keyboard arrives at the total number of sequences.
+Enumerate produces every sequence through the BFS, DepthFirst through
+the iterative depth-first enumerator, whereas
+DynamicProgramming only counts them and never builds a string.
+MatrixPower raises the transition matrix of the same recurrence to
+the power (sequenceLength - 1), which suits very long sequences.
+Bitboard runs the dynamic programming over bitboards of the layout,
+which requires a layout of at most 64 cells. ParallelEnumerate is the
+BFS enumeration spread over the start keys on a pool of threads, and
+WorkStealingEnumerate spreads finer prefix tasks over work-stealing
+threads instead. SparseMatrix runs the dynamic programming on a tiled
+key ordering with every level split over a pool of threads; it is
+picked for DynamicProgramming once the layout has enough states.
+Offload runs the dynamic programming on the BatchedSequenceCounter, on
+the offload device when built for one.
+*/
+enum class CountingMode
+{
+    Enumerate,
+    DepthFirst,
+    ParallelEnumerate,
+    WorkStealingEnumerate,
+    DynamicProgramming,
+    MatrixPower,
+    Bitboard,
+    SparseMatrix,
+    Offload
 };
 
 /*
-The KeyboardLayout class defines the keyboard layout such as the number
-of rows and columns available and the keys located at specific coordinates.
-This provides the flexibility and re-usability to change layout and keys.
-*/ 
-class KeyboardLayout 
+Count types the counting engines can be instantiated with. Plain uint64_t
+is enough for the challenge itself, unsigned __int128 extends the range to
+about 3.4e38, ModularCount keeps results modulo a prime for arbitrarily long
+sequences, and BigCount is an exact arbitrary-precision count.
+*/
+using Count128 = unsigned __int128;
+
+template<uint64_t MODULUS = 1000000007>
+class ModularCount
 {
 private:
-    char invalidKey = 0;
-    CharVector2D layout;
+    uint64_t value = 0;
 public:
-    KeyboardLayout(const char &newInvalidKey, const CharVector2D& newLayout) : invalidKey(newInvalidKey), layout(newLayout)
-    {
-        if (newLayout.empty() || newLayout[0].empty())
-        {
-            throw invalid_argument("Layout dimensions must be non-zero.");
-        }
-    }
+    ModularCount(uint64_t newValue = 0) : value(newValue % MODULUS) {}
 
-    const CharVector2D& GetLayout() const 
+    ModularCount& operator+=(const ModularCount& other)
     {
-        return layout;
+        value = static_cast<uint64_t>((static_cast<Count128>(value) + other.value) % MODULUS);
+        return *this;
     }
-    
-    char GetInvalidKey() const
+
+    friend ModularCount operator*(const ModularCount& lhs, const ModularCount& rhs)
     {
-        return invalidKey;
+        ModularCount product;
+        product.value = static_cast<uint64_t>((static_cast<Count128>(lhs.value) * rhs.value) % MODULUS);
+        return product;
     }
 
-    int GetRows() const 
+    friend bool operator==(const ModularCount& lhs, const ModularCount& rhs)
     {
-        return layout.empty() ? 0 : layout.size();
+        return lhs.value == rhs.value;
     }
 
-    int GetCols() const 
+    uint64_t GetValue() const
     {
-        return layout.empty() ? 0 : layout[0].size();
+        return value;
     }
 };
 
 /*
-The dependencies, i.e. the keyboard layout and the chess-piece are 
-injected to the Keyboard class through the constructor hence this class
-can be reused if the layout and the chess-piece change.
-
-The Keyboard class verifies if the chess-piece move complies to all 
-the constraints and generate unique sequences of the provided length
-for each key as a starting position.
-
-It stores unique sequences in an unordered map.
-
+Unsigned arbitrary-precision integer stored as little-endian base 10^9
+limbs, which keeps the decimal conversion trivial. Only the operations
+the counting engines need are provided.
 */
-class Keyboard
+class BigCount
 {
 private:
-    const unsigned int sequenceLength = 0;
-    const unsigned int maxVowelCount = 0;
-    const KeyboardLayout& keyboardLayout;
-    const ChessPiece* chessPiecePtr;
-    ValidKeyMoves keyMoves;
-    
-    bool IsVowel(char key) 
-    {
-        const string vowels = "AEIOU";
-        return vowels.find(key) != string::npos;
-    }
-    
-    int CountVowels(const string& seq) 
+    static constexpr uint32_t BASE = 1000000000;
+    vector<uint32_t> limbs;
+
+    void Trim()
     {
-        int count = 0;
-        for (char c : seq) 
+        while (!limbs.empty() && (0 == limbs.back()))
         {
-            if (IsVowel(c)) 
-            {
-                count++;
-            }
+            limbs.pop_back();
         }
-        
-        return count;
     }
-    
-    /* 
-    Stores all the valid moves (coordinates) against 
-    their respective keys in an unordered map.  
-    */
-    void SetValidMovesForAllKeys()
+public:
+    BigCount(uint64_t newValue = 0)
     {
-        const int ROWS = keyboardLayout.GetRows();
-        const int COLS = keyboardLayout.GetCols();
-        const auto& layout = keyboardLayout.GetLayout();
-        char invalidKey = keyboardLayout.GetInvalidKey();
-        vector<Coordinates> chessPieceMoves = chessPiecePtr->GetMoves();
-        
-        for (int i = 0; i < ROWS; i++)
+        while (newValue > 0)
         {
-            for (int j = 0; j < COLS; j++)
-            {
-                char key = layout[i][j];
-                vector<Coordinates> moves;
-                if(layout[i][j] != invalidKey)
-                {
-                    for(int k = 0; k < chessPieceMoves.size(); k++)
-                    {
-                        if(chessPiecePtr->IsValidMove(i, j, chessPieceMoves[k].first, chessPieceMoves[k].second, invalidKey, layout))
-                        {
-                            moves.push_back({chessPieceMoves[k].first, chessPieceMoves[k].second});
-                        }
-                    }
-                    
-                    keyMoves.insert({key, moves});
-                }
-            }
+            limbs.push_back(static_cast<uint32_t>(newValue % BASE));
+            newValue /= BASE;
         }
     }
-    
-    /* Returns all the valid moves for a particular key. */
-    vector<Coordinates> GetValidMovesForAKey(char key) const
+
+    BigCount& operator+=(const BigCount& other)
     {
-        return keyMoves.at(key);
+        if (limbs.size() < other.limbs.size())
+        {
+            limbs.resize(other.limbs.size(), 0);
+        }
+
+        uint32_t carry = 0;
+        for (size_t i = 0; i < limbs.size(); ++i)
+        {
+            uint32_t sum = limbs[i] + carry + ((i < other.limbs.size()) ? other.limbs[i] : 0);
+            carry = (sum >= BASE) ? 1 : 0;
+            limbs[i] = sum - carry * BASE;
+        }
+
+        if (carry)
+        {
+            limbs.push_back(carry);
+        }
+
+        return *this;
     }
 
-    /* Generate sequences starting from each key on the keyboard */
-    KeySequences GenerateSequences() 
+    friend BigCount operator*(const BigCount& lhs, const BigCount& rhs)
     {
-        /* 
-        Defines an unordered map to store the sequences
-        generated for each key on the keyboard. 
-        */
-        KeySequences sequences;
+        BigCount product;
+        if (lhs.limbs.empty() || rhs.limbs.empty())
+        {
+            return product;
+        }
 
-        const auto& layout = keyboardLayout.GetLayout();
-        int ROWS = keyboardLayout.GetRows();
-        int COLS = keyboardLayout.GetCols();
-        char invalidKey = keyboardLayout.GetInvalidKey();
-
-        /* Iterates through each key on the keyboard */
-        for (int i = 0; i < ROWS; ++i)
-        {
-            for (int j = 0; j < COLS; ++j)
-            {
-                /* Ignores blank/empty cells/positions */
-                if (layout[i][j] != invalidKey) 
-                {
-                    queue<pair<string, Coordinates>> q;
-                    /* Starts with a sequence containing only the starting character */
-                    q.push({string(1, layout[i][j]), {i, j}});
-                    
-                    /* 
-                    Initiates a breadth-first search(BFS) search for a key 
-                    to explore all possible sequences starting from it.
-                    While the queue is not empty:
-                      - Pop a sequence (corresponding to a key) and its 
-                        latest coordinates and from the queue.
-                      - Explore all the valid moves from the current key
-                      - For each valid move:
-                        - Append the destination key to the sequence.
-                        - Add the destination key and the updated coordinates 
-                          to the queue for further exploration
-                      - Repeat this process until the sequence length reaches the 
-                        required length, or there are no more valid moves.
-                    */
-                    while (!q.empty()) 
-                    {
-                        auto [seq, pos] = q.front();
-                        q.pop();
-                        auto [x, y] = pos;
-                        
-                        /*
-                        Checks if vowels count in a sequence exceeds 
-                        the provided limit, and if so skips further 
-                        exploration from this sequence 
-                        */
-                        if (CountVowels(seq) > maxVowelCount)
-                        {
-                            continue;
-                        }
-                        
-                        /*
-                        Check if a sequence length reaches the required length, 
-                        and if so add it to the map against the key, i.e. the starting 
-                        key of the sequence. This applies to all sequences.
-                        */ 
-                        if (seq.size() == sequenceLength) 
-                        {
-                            sequences[layout[i][j]].push_back(seq);
-                            continue;
-                        }
-                        
-                        /* Loops through the valid moves from the current position */
-                        for (const auto& move : GetValidMovesForAKey(layout[x][y])) 
-                        {
-                            int newX = x + move.first;
-                            int newY = y + move.second;
-                            q.push({seq + layout[newX][newY], {newX, newY}});
-                            
-                        }
-                    }
-                }
+        vector<uint64_t> columns(lhs.limbs.size() + rhs.limbs.size(), 0);
+        for (size_t i = 0; i < lhs.limbs.size(); ++i)
+        {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < rhs.limbs.size(); ++j)
+            {
+                uint64_t current = columns[i + j] + static_cast<uint64_t>(lhs.limbs[i]) * rhs.limbs[j] + carry;
+                columns[i + j] = current % BASE;
+                carry = current / BASE;
             }
+
+            columns[i + rhs.limbs.size()] += carry;
         }
 
-        return sequences;
+        product.limbs.assign(columns.begin(), columns.end());
+        product.Trim();
+        return product;
     }
 
-public:
-    /* 
-    DI: The dependencies: keyboard layout and the chess-piece
-    are injected through the constructor. 
-    */
-    Keyboard(const unsigned int &_sequenceLength, const unsigned int &_maxVowelCount, const KeyboardLayout& _keyboardLayout, const ChessPiece* _chessPiecePtr)
-        : sequenceLength(_sequenceLength), maxVowelCount(_maxVowelCount), keyboardLayout(_keyboardLayout), chessPiecePtr(_chessPiecePtr) 
+    /* Subtracts a count that is not larger than this one. */
+    BigCount& operator-=(const BigCount& other)
     {
-        try
+        if (*this < other)
         {
-            if(0 == sequenceLength)
-            {
-                throw invalid_argument("Sequence length must be non-zero.");
-            }
-            
-            SetValidMovesForAllKeys();
-        } 
-        catch (const exception& e) 
+            throw invalid_argument("BigCount subtraction would be negative.");
+        }
+
+        uint32_t borrow = 0;
+        for (size_t i = 0; i < limbs.size(); ++i)
         {
-            cerr << "Exception during Keyboard initialization: " << e.what() << endl;
-            throw;
+            uint64_t subtrahend = static_cast<uint64_t>(borrow) + ((i < other.limbs.size()) ? other.limbs[i] : 0);
+            borrow = (limbs[i] < subtrahend) ? 1 : 0;
+            limbs[i] = static_cast<uint32_t>(limbs[i] + static_cast<uint64_t>(borrow) * BASE - subtrahend);
         }
+
+        Trim();
+        return *this;
     }
 
-    /*
-    Displays the total number of unique sequences 
-    possible with the provided constraints.
-    */ 
-    void displayTotalSequences() 
+    friend bool operator==(const BigCount& lhs, const BigCount& rhs)
     {
-        try
+        return lhs.limbs == rhs.limbs;
+    }
+
+    friend bool operator<(const BigCount& lhs, const BigCount& rhs)
+    {
+        if (lhs.limbs.size() != rhs.limbs.size())
         {
-            int totalSequenceCout = 0;
-            auto sequences = GenerateSequences();
-            for (const auto& seq : sequences) 
-            {
-                totalSequenceCout += seq.second.size();
-            }
-    
-            cout << "Total number of sequences: " << totalSequenceCout << endl;
+            return lhs.limbs.size() < rhs.limbs.size();
         }
-        catch (const exception& e) 
+
+        return std::lexicographical_compare(lhs.limbs.rbegin(), lhs.limbs.rend(), rhs.limbs.rbegin(), rhs.limbs.rend());
+    }
+
+    string ToString() const
+    {
+        if (limbs.empty())
         {
-            cerr << "Exception during sequence generation: " << e.what() << endl;
-            throw;
+            return "0";
         }
-        
+
+        string digits = std::to_string(limbs.back());
+        for (size_t i = limbs.size() - 1; i-- > 0;)
+        {
+            string limb = std::to_string(limbs[i]);
+            digits += string(9 - limb.size(), '0') + limb;
+        }
+
+        return digits;
     }
 };
 
-int main() 
+/*
+Count that sticks at UINT64_MAX instead of wrapping around. Every count
+below UINT64_MAX is exact, which is all a SequenceRanker needs to unrank
+a 64-bit rank: it only ever subtracts counts smaller than the rank. The
+completion tables then take 8 bytes per state whatever the length.
+*/
+class SaturatingCount
 {
-    char invalidKey = 0;
-    CharVector2D layout = {
-        {'A', 'B', 'C', 'D', 'E'},
-        {'F', 'G', 'H', 'I', 'J'},
-        {'K', 'L', 'M', 'N', 'O'},
-        {invalidKey, '1', '2', '3', invalidKey}
-    };
+private:
+    uint64_t value = 0;
+public:
+    SaturatingCount(uint64_t newValue = 0) : value(newValue) {}
 
-    try
+    SaturatingCount& operator+=(const SaturatingCount& other)
     {
-        KeyboardLayout keyboardLayout(invalidKey, layout);
-        Knight knight;
-        Keyboard keyboard(10, 2, keyboardLayout, &knight);
-    
-        keyboard.displayTotalSequences();
+        value = (value > UINT64_MAX - other.value) ? UINT64_MAX : value + other.value;
+        return *this;
+    }
+
+    /* Only meant for exact counts, i.e. below UINT64_MAX */
+    SaturatingCount& operator-=(const SaturatingCount& other)
+    {
+        value -= other.value;
+        return *this;
+    }
+
+    friend bool operator<(const SaturatingCount& lhs, const SaturatingCount& rhs)
+    {
+        return lhs.value < rhs.value;
+    }
+
+    uint64_t GetValue() const
+    {
+        return value;
+    }
+};
+
+/* Converts any of the supported count types to its decimal representation. */
+inline string ToString(uint64_t count)
+{
+    return std::to_string(count);
+}
+
+inline string ToString(Count128 count)
+{
+    if (0 == count)
+    {
+        return "0";
+    }
+
+    string digits;
+    while (count > 0)
+    {
+        digits += static_cast<char>('0' + static_cast<int>(count % 10));
+        count /= 10;
+    }
+
+    return string(digits.rbegin(), digits.rend());
+}
+
+template<uint64_t MODULUS>
+string ToString(const ModularCount<MODULUS>& count)
+{
+    return std::to_string(count.GetValue());
+}
+
+inline string ToString(const BigCount& count)
+{
+    return count.ToString();
+}
+
+inline string ToString(const SaturatingCount& count)
+{
+    return std::to_string(count.GetValue());
+}
+
+/*
+Parses the decimal representation of any of the supported count types,
+using only the arithmetic the counting engines already rely on.
+*/
+template<typename CountType>
+CountType ParseCount(const string& digits)
+{
+    if (digits.empty())
+    {
+        throw invalid_argument("Empty count.");
+    }
+
+    CountType count(0);
+    for (char digit : digits)
+    {
+        if ((digit < '0') || (digit > '9'))
+        {
+            throw invalid_argument("Invalid count: " + digits);
+        }
+
+        count = count * CountType(10);
+        count += CountType(static_cast<uint64_t>(digit - '0'));
+    }
+
+    return count;
+}
+
+/*
+Decides which keys count against the vowel limit. It is resolved once per
+key into the move table, so it may be arbitrarily expensive; the default
+one looks the key up in a table built at compile time.
+*/
+using KeyPredicate = std::function<bool(KeyCode)>;
+
+constexpr std::array<bool, 256> MakeVowelTable()
+{
+    std::array<bool, 256> table{};
+    for (char vowel : {'A', 'E', 'I', 'O', 'U'})
+    {
+        table[static_cast<unsigned char>(vowel)] = true;
+    }
+
+    return table;
+}
+
+constexpr std::array<bool, 256> VOWEL_TABLE = MakeVowelTable();
+
+inline constexpr bool IsVowelKey(KeyCode key)
+{
+    return (key < VOWEL_TABLE.size()) && VOWEL_TABLE[key];
+}
+
+/*
+Layouts with at most 64 cells can also be represented as bitboards, the
+way chess engines represent a board: bit (x * COLS + y) stands for the
+cell at row x and column y.
+*/
+using Bitboard = uint64_t;
+
+constexpr int BITBOARD_CELLS = 64;
+
+/*
+Shifts every cell of a bitboard by the given move. Cells that would leave
+the layout, including those that would wrap onto a neighbouring row, are
+dropped.
+*/
+inline Bitboard ShiftBitboard(Bitboard board, int moveX, int moveY, int rows, int cols)
+{
+    if ((abs(moveX) >= rows) || (abs(moveY) >= cols))
+    {
+        return 0;
+    }
+
+    /* Clears the columns whose cells would cross the left or right edge */
+    Bitboard columnMask = 0;
+    for (int j = std::max(0, -moveY); j < std::min(cols, cols - moveY); ++j)
+    {
+        columnMask |= Bitboard(1) << j;
+    }
+
+    Bitboard sourceMask = 0;
+    for (int i = 0; i < rows; ++i)
+    {
+        sourceMask |= columnMask << (i * cols);
+    }
+
+    const int SHIFT = moveX * cols + moveY;
+    board &= sourceMask;
+    board = (SHIFT >= 0) ? (board << SHIFT) : (board >> -SHIFT);
+
+    /* Clears the rows beyond the bottom edge */
+    const int CELLS = rows * cols;
+    return (CELLS >= BITBOARD_CELLS) ? board : (board & ((Bitboard(1) << CELLS) - 1));
+}
+
+/* Returns the index of the lowest set cell and clears it from the bitboard. */
+inline int PopLowestCell(Bitboard& board)
+{
+    int cell = __builtin_ctzll(board);
+    board &= board - 1;
+    return cell;
+}
+
+/*
+Fixed-width sequences stored back to back in one contiguous buffer, the
+i-th sequence being the width bytes at i * width, where the width is set
+by the first sequence appended. Compared to a vector of strings that is
+one growing block instead of one heap node per sequence; the sequences
+are read back as string_views.
+*/
+class PackedSequences
+{
+private:
+    size_t width = 0;
+    string data;
+public:
+    /* Iterates over the sequences as string_views. */
+    class const_iterator
+    {
+    private:
+        const PackedSequences* sequences;
+        size_t index;
+    public:
+        const_iterator(const PackedSequences* newSequences, size_t newIndex) : sequences(newSequences), index(newIndex) {}
+
+        std::string_view operator*() const
+        {
+            return (*sequences)[index];
+        }
+
+        const_iterator& operator++()
+        {
+            index++;
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return index == other.index;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return index != other.index;
+        }
+    };
+
+    void Append(std::string_view sequence)
+    {
+        if (data.empty())
+        {
+            width = sequence.size();
+        }
+        else if (sequence.size() != width)
+        {
+            throw invalid_argument("All packed sequences must have the same length.");
+        }
+
+        data.append(sequence);
+    }
+
+    void Append(const PackedSequences& other)
+    {
+        if (!other.empty() && !empty() && (other.width != width))
+        {
+            throw invalid_argument("All packed sequences must have the same length.");
+        }
+
+        if (empty())
+        {
+            width = other.width;
+        }
+
+        data.append(other.data);
+    }
+
+    size_t size() const
+    {
+        return (0 == width) ? 0 : data.size() / width;
+    }
+
+    bool empty() const
+    {
+        return data.empty();
+    }
+
+    std::string_view operator[](size_t index) const
+    {
+        return std::string_view(data).substr(index * width, width);
+    }
+
+    const_iterator begin() const
+    {
+        return {this, 0};
+    }
+
+    const_iterator end() const
+    {
+        return {this, size()};
+    }
+
+    size_t GetWidth() const
+    {
+        return width;
+    }
+
+    /* All the sequences as one block of size() * GetWidth() bytes. */
+    std::string_view GetData() const
+    {
+        return data;
+    }
+};
+
+using KeySequences = unordered_map<char, PackedSequences>;
+
+/*
+Push-style consumer of generated sequences. The enumerators hand every
+finished sequence to the sink as soon as it is produced, so nothing but
+the traversal frontier has to be kept in memory. The view is only valid
+during the call. Sinks are called from a single thread.
+*/
+class SequenceSink
+{
+public:
+    virtual ~SequenceSink() = default;
+    virtual void Consume(std::string_view sequence) = 0;
+};
+
+/* Writes every sequence on its own line to an output stream, e.g. cout. */
+class StreamSequenceSink : public SequenceSink
+{
+private:
+    std::ostream& stream;
+public:
+    explicit StreamSequenceSink(std::ostream& newStream) : stream(newStream) {}
+
+    void Consume(std::string_view sequence) override
+    {
+        stream << sequence << '\n';
+    }
+};
+
+/* Writes every sequence on its own line to a file. */
+class FileSequenceSink : public SequenceSink
+{
+private:
+    std::ofstream file;
+public:
+    explicit FileSequenceSink(const string& path) : file(path)
+    {
+        if (!file)
+        {
+            throw std::runtime_error("Unable to open sequence file: " + path);
+        }
+    }
+
+    void Consume(std::string_view sequence) override
+    {
+        file << sequence << '\n';
+    }
+};
+
+/* Only counts the sequences. */
+class CountingSequenceSink : public SequenceSink
+{
+private:
+    uint64_t count = 0;
+public:
+    void Consume(std::string_view) override
+    {
+        count++;
+    }
+
+    uint64_t GetCount() const
+    {
+        return count;
+    }
+};
+
+/* Collects the sequences against their starting key, as GenerateSequences() does. */
+class KeySequencesSink : public SequenceSink
+{
+private:
+    KeySequences sequences;
+public:
+    void Consume(std::string_view sequence) override
+    {
+        sequences[sequence.front()].Append(sequence);
+    }
+
+    KeySequences& GetSequences()
+    {
+        return sequences;
+    }
+};
+
+/* One edit of a layout cell, see KeyboardLayout::SetKey(). */
+struct LayoutEdit
+{
+    int x;
+    int y;
+    KeyCode oldKey;
+    KeyCode newKey;
+};
+
+/*
+The KeyboardLayout class defines the keyboard layout such as the number
+of rows and columns available and the keys located at specific coordinates.
+This provides the flexibility and re-usability to change layout and keys.
+
+The keys are stored in a single contiguous row-major buffer, the key at
+(x, y) being at x * stride + y, so large layouts need one allocation and
+no pointer chasing. Keys are KeyCodes, so layouts are not limited to the
+256 values of a char; a layout of chars can still be given as rows.
+*/ 
+class KeyboardLayout 
+{
+private:
+    KeyCode invalidKey = 0;
+    int rows = 0;
+    int cols = 0;
+    vector<KeyCode> keys;
+    /* Every edit since the layout was created, the version being their number */
+    vector<LayoutEdit> edits;
+public:
+    KeyboardLayout(const char &newInvalidKey, const CharVector2D& newLayout) : invalidKey(static_cast<unsigned char>(newInvalidKey))
+    {
+        if (newLayout.empty() || newLayout[0].empty())
+        {
+            throw invalid_argument("Layout dimensions must be non-zero.");
+        }
+
+        rows = newLayout.size();
+        cols = newLayout[0].size();
+        keys.reserve(rows * cols);
+        for (const auto& row : newLayout)
+        {
+            if (static_cast<int>(row.size()) != cols)
+            {
+                throw invalid_argument("All layout rows must have the same number of keys.");
+            }
+
+            for (char key : row)
+            {
+                keys.push_back(static_cast<unsigned char>(key));
+            }
+        }
+    }
+
+    /* Creates a layout from its row-major keys. */
+    KeyboardLayout(KeyCode newInvalidKey, int newRows, int newCols, const vector<KeyCode>& newKeys)
+        : invalidKey(newInvalidKey), rows(newRows), cols(newCols), keys(newKeys)
+    {
+        if ((newRows <= 0) || (newCols <= 0))
+        {
+            throw invalid_argument("Layout dimensions must be non-zero.");
+        }
+
+        if (newKeys.size() != static_cast<size_t>(newRows) * newCols)
+        {
+            throw invalid_argument("Layout keys do not match its dimensions.");
+        }
+    }
+
+    /* Returns all the keys in row-major order. */
+    const vector<KeyCode>& GetKeys() const 
+    {
+        return keys;
+    }
+
+    /*
+    Replaces the key of a cell, the invalid key blanking it, and records
+    the edit. The Keyboards over the layout catch up with the edits on
+    their next query, see Keyboard::ApplyLayoutEdits().
+    */
+    void SetKey(int x, int y, KeyCode key)
+    {
+        if ((x < 0) || (x >= rows) || (y < 0) || (y >= cols))
+        {
+            throw invalid_argument("Layout cell is out of bounds.");
+        }
+
+        KeyCode& cell = keys[x * cols + y];
+        if (cell != key)
+        {
+            edits.push_back({x, y, cell, key});
+            cell = key;
+        }
+    }
+
+    void MarkInvalid(int x, int y)
+    {
+        SetKey(x, y, invalidKey);
+    }
+
+    /* Number of edits made to the layout so far. */
+    uint64_t GetVersion() const
+    {
+        return edits.size();
+    }
+
+    /* Returns the edits in the order they were made, the first GetVersion() ones. */
+    const vector<LayoutEdit>& GetEdits() const
+    {
+        return edits;
+    }
+
+    KeyCode GetKey(int x, int y) const
+    {
+        return keys[x * cols + y];
+    }
+
+    /* Checks if (x, y) is within the layout and not an invalid key. */
+    bool IsValidKey(int x, int y) const
+    {
+        return (x >= 0) && (x < rows) && (y >= 0) && (y < cols) && (keys[x * cols + y] != invalidKey);
+    }
+    
+    KeyCode GetInvalidKey() const
+    {
+        return invalidKey;
+    }
+
+    int GetRows() const 
+    {
+        return rows;
+    }
+
+    int GetCols() const 
+    {
+        return cols;
+    }
+
+    /*
+    Returns a stable 64-bit FNV-1a hash of the dimensions, the invalid
+    key and the keys of the layout, identical across runs and builds.
+    */
+    uint64_t GetHash() const
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](uint64_t value)
+        {
+            for (int byte = 0; byte < 8; ++byte)
+            {
+                hash = (hash ^ ((value >> (byte * 8)) & 0xFF)) * 1099511628211ULL;
+            }
+        };
+
+        mix(GetRows());
+        mix(GetCols());
+        mix(invalidKey);
+        for (KeyCode key : keys)
+        {
+            mix(key);
+        }
+
+        return hash;
+    }
+
+    /* Checks if the layout is small enough to be represented as a bitboard. */
+    bool FitsInBitboard() const
+    {
+        return GetRows() * GetCols() <= BITBOARD_CELLS;
+    }
+
+    /* Returns the bitboard of all the valid (non-blank) keys. */
+    Bitboard GetOccupancyMask() const
+    {
+        if (!FitsInBitboard())
+        {
+            throw invalid_argument("Layout does not fit in a 64-bit bitboard.");
+        }
+
+        Bitboard occupancy = 0;
+        for (size_t cell = 0; cell < keys.size(); ++cell)
+        {
+            if (keys[cell] != invalidKey)
+            {
+                occupancy |= Bitboard(1) << cell;
+            }
+        }
+
+        return occupancy;
+    }
+};
+
+/*
+Creating a base abstract class/interface ChessPiece from which
+different child classes could be derived, e.g. Knight, Bishop, Rook,
+Queen and King.
+Since these are specific chess-pieces they would have their own 
+specific move coordinates and valid/invalid moves.
+*/ 
+class ChessPiece
+{
+public:
+    virtual ~ChessPiece() = default;
+
+    /* Stable name of the chess-piece, e.g. used to key cached results. */
+    virtual string GetName() const = 0;
+    virtual vector<Coordinates> GetMoves() const = 0;
+    virtual bool IsValidMove(int x, int y, int moveX, int moveY, const KeyboardLayout& layout) const = 0;
+
+    /*
+    Returns every valid move from the given position. By default these are
+    the moves that pass IsValidMove(); sliding pieces override it to walk
+    their directions until they leave the layout or hit an invalid key.
+    */
+    virtual vector<Coordinates> GetReachableMoves(int x, int y, const KeyboardLayout& layout) const
+    {
+        vector<Coordinates> reachableMoves;
+        for (const auto& move : GetMoves())
+        {
+            if (IsValidMove(x, y, move.first, move.second, layout))
+            {
+                reachableMoves.push_back(move);
+            }
+        }
+
+        return reachableMoves;
+    }
+
+    /*
+    Returns the cells whose reachable moves may change when the given cell
+    becomes valid or invalid. By default these are the cells one move away
+    from it, which holds for every piece whose moves only depend on their
+    destination; sliding pieces override it.
+    */
+    virtual vector<Coordinates> GetDependentCells(int x, int y, const KeyboardLayout& layout) const
+    {
+        vector<Coordinates> dependentCells;
+        for (const auto& [moveX, moveY] : GetMoves())
+        {
+            if (layout.IsValidKey(x - moveX, y - moveY))
+            {
+                dependentCells.push_back({x - moveX, y - moveY});
+            }
+        }
+
+        return dependentCells;
+    }
+
+    /*
+    Precomputes the attack bitboard of every cell of a layout of at most
+    64 cells, i.e. the set of cells the chess-piece can move to from it.
+    */
+    vector<Bitboard> GetAttackBitboards(const KeyboardLayout& layout) const
+    {
+        const int ROWS = layout.GetRows();
+        const int COLS = layout.GetCols();
+        if (!layout.FitsInBitboard())
+        {
+            throw invalid_argument("Layout does not fit in a 64-bit bitboard.");
+        }
+
+        vector<Bitboard> attacks(ROWS * COLS, 0);
+        for (int x = 0; x < ROWS; ++x)
+        {
+            for (int y = 0; y < COLS; ++y)
+            {
+                if (!layout.IsValidKey(x, y))
+                {
+                    continue;
+                }
+
+                for (const auto& move : GetReachableMoves(x, y, layout))
+                {
+                    attacks[x * COLS + y] |= ShiftBitboard(Bitboard(1) << (x * COLS + y), move.first, move.second, ROWS, COLS);
+                }
+            }
+        }
+
+        return attacks;
+    }
+};
+
+
+/*
+Static-polymorphism path for chess-pieces known at compile time. A piece
+derives from StaticChessPiece<Piece> (CRTP) and provides its move offsets
+as a constexpr std::array MOVES together with a constexpr IsValidOffset()
+for the shape of a move. The Keyboard recognizes such pieces and builds
+its move table through IsValidStaticMove(), which the compiler inlines
+along with the whole move set, while the virtual ChessPiece interface
+keeps working for pieces defined at runtime.
+*/
+template<typename Piece>
+class StaticChessPiece : public ChessPiece
+{
+public:
+    /* Check if it's valid move, without any virtual dispatch. */
+    static bool IsValidStaticMove(int x, int y, int moveX, int moveY, const KeyboardLayout& layout)
+    {
+        /* 
+        Check if new position is within the bounds of the keyboard 
+        layout and if it's not an invalid key (empty cell)
+        */
+        return layout.IsValidKey(x + moveX, y + moveY) &&
+               Piece::IsValidOffset(moveX, moveY);
+    }
+
+    string GetName() const override
+    {
+        return Piece::NAME;
+    }
+
+    vector<Coordinates> GetMoves() const override 
+    {
+        return vector<Coordinates>(Piece::MOVES.begin(), Piece::MOVES.end());
+    }
+
+    bool IsValidMove(int x, int y, int moveX, int moveY, const KeyboardLayout& layout) const override
+    {
+        return IsValidStaticMove(x, y, moveX, moveY, layout);
+    }
+};
+
+/*
+Derived a Knight class from the ChessPiece abstract class/interface,
+through StaticChessPiece, specific to this challenge and providing
+the moves specific to Knight moves at compile time.
+*/ 
+class Knight : public StaticChessPiece<Knight> 
+{
+public:
+    static constexpr const char* NAME = "Knight";
+
+    /* The possible moves for a Knight. */
+    static constexpr std::array<Coordinates, 8> MOVES = {{
+        {-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1}
+    }};
+
+    /*
+    The Knight moves in L shaped motion horizontally and 
+    vertically, and in forward a backward direction.
+    */ 
+    static constexpr bool IsValidOffset(int moveX, int moveY)
+    {
+        return ((1 == moveX * moveX) && (4 == moveY * moveY)) ||
+               ((4 == moveX * moveX) && (1 == moveY * moveY));
+    }
+};
+
+/* A King moves a single step in any direction. */
+class King : public StaticChessPiece<King>
+{
+public:
+    static constexpr const char* NAME = "King";
+
+    static constexpr std::array<Coordinates, 8> MOVES = {{
+        {-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}
+    }};
+
+    static constexpr bool IsValidOffset(int moveX, int moveY)
+    {
+        return ((0 != moveX) || (0 != moveY)) && (moveX * moveX <= 1) && (moveY * moveY <= 1);
+    }
+};
+
+/*
+Base class of the sliding chess-pieces. GetMoves() returns the directions
+the piece slides in, and every move is a whole number of steps in one of
+them. A piece cannot leave the layout, land on an invalid key or pass
+through one, so its reachable moves are found by walking each direction
+until it is blocked.
+*/
+class SlidingChessPiece : public ChessPiece
+{
+private:
+    vector<Coordinates> directions;
+protected:
+    explicit SlidingChessPiece(const vector<Coordinates>& newDirections) : directions(newDirections) {}
+public:
+    vector<Coordinates> GetMoves() const override
+    {
+        return directions;
+    }
+
+    /* Check if it's valid move, i.e. a clear path along one of the directions. */
+    bool IsValidMove(int x, int y, int moveX, int moveY, const KeyboardLayout& layout) const override
+    {
+        for (const auto& direction : directions)
+        {
+            int steps = (0 != direction.first) ? moveX / direction.first : moveY / direction.second;
+            if ((steps <= 0) || (steps * direction.first != moveX) || (steps * direction.second != moveY))
+            {
+                continue;
+            }
+
+            for (const auto& move : GetReachableMoves(x, y, layout))
+            {
+                if ((move.first == moveX) && (move.second == moveY))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        return false;
+    }
+
+    vector<Coordinates> GetReachableMoves(int x, int y, const KeyboardLayout& layout) const override
+    {
+        vector<Coordinates> reachableMoves;
+
+        for (const auto& [stepX, stepY] : directions)
+        {
+            int newX = x + stepX;
+            int newY = y + stepY;
+            while (layout.IsValidKey(newX, newY))
+            {
+                reachableMoves.push_back({newX - x, newY - y});
+                newX += stepX;
+                newY += stepY;
+            }
+        }
+
+        return reachableMoves;
+    }
+
+    /* The cells sliding onto the given cell, up to the first invalid key of every direction. */
+    vector<Coordinates> GetDependentCells(int x, int y, const KeyboardLayout& layout) const override
+    {
+        vector<Coordinates> dependentCells;
+
+        for (const auto& [stepX, stepY] : directions)
+        {
+            int newX = x - stepX;
+            int newY = y - stepY;
+            while (layout.IsValidKey(newX, newY))
+            {
+                dependentCells.push_back({newX, newY});
+                newX -= stepX;
+                newY -= stepY;
+            }
+        }
+
+        return dependentCells;
+    }
+};
+
+/* A Bishop slides diagonally. */
+class Bishop : public SlidingChessPiece
+{
+public:
+    Bishop() : SlidingChessPiece({{-1, -1}, {-1, 1}, {1, -1}, {1, 1}}) {}
+
+    string GetName() const override
+    {
+        return "Bishop";
+    }
+};
+
+/* A Rook slides horizontally and vertically. */
+class Rook : public SlidingChessPiece
+{
+public:
+    Rook() : SlidingChessPiece({{-1, 0}, {1, 0}, {0, -1}, {0, 1}}) {}
+
+    string GetName() const override
+    {
+        return "Rook";
+    }
+};
+
+/* A Queen slides both like a Bishop and like a Rook. */
+class Queen : public SlidingChessPiece
+{
+public:
+    Queen() : SlidingChessPiece({{-1, -1}, {-1, 1}, {1, -1}, {1, 1}, {-1, 0}, {1, 0}, {0, -1}, {0, 1}}) {}
+
+    string GetName() const override
+    {
+        return "Queen";
+    }
+};
+
+/*
+Compile-time counterpart of the Keyboard dynamic-programming engine for
+layouts, static chess-pieces and parameters fixed at compile time, so that
+a compiled-in configuration carries its answer as a constant. It runs the
+same (key, vowels used) recurrence on std::array storage, with up to
+CONSTEXPR_MAX_VOWEL_STATES vowel states, using the default vowel check.
+*/
+template<size_t ROWS, size_t COLS>
+using CharArray2D = std::array<std::array<char, COLS>, ROWS>;
+
+constexpr unsigned int CONSTEXPR_MAX_VOWEL_STATES = 16;
+
+template<typename Piece, size_t ROWS, size_t COLS>
+constexpr uint64_t CountSequencesAtCompileTime(const CharArray2D<ROWS, COLS>& layout, char invalidKey,
+                                               unsigned int sequenceLength, unsigned int maxVowelCount)
+{
+    if ((0 == sequenceLength) || (maxVowelCount >= CONSTEXPR_MAX_VOWEL_STATES))
+    {
+        throw invalid_argument("Unsupported compile-time sequence parameters.");
+    }
+
+    using StateArray = std::array<std::array<uint64_t, CONSTEXPR_MAX_VOWEL_STATES>, ROWS * COLS>;
+    StateArray counts{};
+
+    for (size_t i = 0; i < ROWS; ++i)
+    {
+        for (size_t j = 0; j < COLS; ++j)
+        {
+            unsigned int vowels = IsVowelKey(static_cast<unsigned char>(layout[i][j])) ? 1 : 0;
+            if ((layout[i][j] != invalidKey) && (vowels <= maxVowelCount))
+            {
+                counts[i * COLS + j][vowels] = 1;
+            }
+        }
+    }
+
+    for (unsigned int level = 1; level < sequenceLength; ++level)
+    {
+        StateArray nextCounts{};
+
+        for (int x = 0; x < static_cast<int>(ROWS); ++x)
+        {
+            for (int y = 0; y < static_cast<int>(COLS); ++y)
+            {
+                if (layout[x][y] == invalidKey)
+                {
+                    continue;
+                }
+
+                for (const auto& move : Piece::MOVES)
+                {
+                    int newX = x + move.first;
+                    int newY = y + move.second;
+                    if ((newX < 0) || (newX >= static_cast<int>(ROWS)) || (newY < 0) || (newY >= static_cast<int>(COLS)) ||
+                        (layout[newX][newY] == invalidKey) || !Piece::IsValidOffset(move.first, move.second))
+                    {
+                        continue;
+                    }
+
+                    unsigned int addedVowels = IsVowelKey(static_cast<unsigned char>(layout[newX][newY])) ? 1 : 0;
+                    for (unsigned int v = 0; v + addedVowels <= maxVowelCount; ++v)
+                    {
+                        nextCounts[newX * COLS + newY][v + addedVowels] += counts[x * COLS + y][v];
+                    }
+                }
+            }
+        }
+
+        counts = nextCounts;
+    }
+
+    uint64_t totalSequenceCount = 0;
+    for (const auto& cellCounts : counts)
+    {
+        for (uint64_t count : cellCounts)
+        {
+            totalSequenceCount += count;
+        }
+    }
+
+    return totalSequenceCount;
+}
+
+/* The shipped layout and parameters, and their answer computed at compile time; main() runs the same. */
+constexpr char DEFAULT_INVALID_KEY = 0;
+constexpr unsigned int DEFAULT_SEQUENCE_LENGTH = 10;
+constexpr unsigned int DEFAULT_MAX_VOWEL_COUNT = 2;
+constexpr CharArray2D<4, 5> DEFAULT_LAYOUT = {{
+    {'A', 'B', 'C', 'D', 'E'},
+    {'F', 'G', 'H', 'I', 'J'},
+    {'K', 'L', 'M', 'N', 'O'},
+    {DEFAULT_INVALID_KEY, '1', '2', '3', DEFAULT_INVALID_KEY}
+}};
+constexpr uint64_t DEFAULT_SEQUENCE_COUNT = CountSequencesAtCompileTime<Knight>(DEFAULT_LAYOUT, DEFAULT_INVALID_KEY,
+                                                                                DEFAULT_SEQUENCE_LENGTH, DEFAULT_MAX_VOWEL_COUNT);
+static_assert(1013398 == DEFAULT_SEQUENCE_COUNT, "Unexpected number of sequences for the shipped layout.");
+
+/*
+A single valid move in the KeyMoveTable: the index of the destination
+key together with its vowel flag, so the traversal never has to look
+the destination key up again.
+*/
+struct KeyMove
+{
+    int key;
+    unsigned int vowel;
+};
+
+/* A non-owning view over the contiguous valid moves of one key. */
+struct KeyMoveRange
+{
+    const KeyMove* first;
+    const KeyMove* last;
+
+    const KeyMove* begin() const { return first; }
+    const KeyMove* end() const { return last; }
+    size_t size() const { return last - first; }
+};
+
+/*
+Flat, index-based table of the valid moves of every key. Build() gives
+the valid keys of the layout dense indices 0..N-1 in row-major order, and
+stores their moves back to back (CSR layout): the moves of key k are
+moves[offsets[k]] .. moves[ends[k] - 1]. The traversals then work on
+indices only, with no hashing and no per-step allocation. Update() patches
+the rows in place after layout edits, so they may then be out of order
+and have room to grow, up to limits[k].
+*/
+struct KeyMoveTable
+{
+    vector<KeyCode> keys;
+    /* The keys as chars for the enumerators, empty if any key is not a char */
+    vector<char> keyChars;
+    vector<Coordinates> positions;
+    vector<unsigned int> vowels;
+    vector<int> offsets;
+    vector<int> ends;
+    vector<KeyMove> moves;
+    /* The same moves grouped by destination, each entry holding the source key */
+    vector<int> incomingOffsets;
+    vector<int> incomingEnds;
+    vector<KeyMove> incomingMoves;
+    /* Key index of each layout cell in row-major order, -1 for invalid cells */
+    vector<int> cellKeys;
+    /* Ends of the room of every row, only set by Update() */
+    vector<int> limits;
+    vector<int> incomingLimits;
+
+    int GetKeyCount() const
+    {
+        return keys.size();
+    }
+
+    KeyMoveRange GetMoves(int key) const
+    {
+        return {moves.data() + offsets[key], moves.data() + ends[key]};
+    }
+
+    KeyMoveRange GetIncomingMoves(int key) const
+    {
+        return {incomingMoves.data() + incomingOffsets[key], incomingMoves.data() + incomingEnds[key]};
+    }
+
+    /*
+    Returns the keys by row-major position of their cells, i.e. in key
+    order until Update() indexes keys out of it. The enumerators and the
+    rankers start their sequences in this order, which then only depends
+    on the layout and not on the edits it went through.
+    */
+    vector<int> GetKeysInCellOrder() const
+    {
+        vector<int> order;
+        order.reserve(keys.size());
+        for (int key : cellKeys)
+        {
+            if (key >= 0)
+            {
+                order.push_back(key);
+            }
+        }
+
+        return order;
+    }
+
+    /*
+    Builds the table for a layout, indexing the valid keys in row-major
+    order. The valid moves of a position are produced by a visitor given
+    as a template parameter, visitValidMoves(x, y, layout, emit), so that
+    the moves of a StaticChessPiece are fully inlined.
+    */
+    template<typename MoveVisitor>
+    void Build(const KeyboardLayout& layout, MoveVisitor visitValidMoves, const KeyPredicate& isVowel)
+    {
+        const int COLS = layout.GetCols();
+
+        SetKeys(layout, isVowel);
+        for (const auto& [i, j] : positions)
+        {
+            offsets.push_back(moves.size());
+            visitValidMoves(i, j, layout, [&, i = i, j = j](int moveX, int moveY)
+            {
+                int newKey = cellKeys[(i + moveX) * COLS + j + moveY];
+                moves.push_back({newKey, vowels[newKey]});
+            });
+
+            ends.push_back(moves.size());
+        }
+
+        SetIncomingMoves();
+    }
+
+    /* Indexes the valid keys of a layout in row-major order. */
+    void SetKeys(const KeyboardLayout& layout, const KeyPredicate& isVowel)
+    {
+        const int ROWS = layout.GetRows();
+        const int COLS = layout.GetCols();
+
+        cellKeys.assign(ROWS * COLS, -1);
+        for (int i = 0; i < ROWS; i++)
+        {
+            for (int j = 0; j < COLS; j++)
+            {
+                if(layout.IsValidKey(i, j))
+                {
+                    cellKeys[i * COLS + j] = keys.size();
+                    keys.push_back(layout.GetKey(i, j));
+                    positions.push_back({i, j});
+                    vowels.push_back(isVowel(layout.GetKey(i, j)) ? 1 : 0);
+                }
+            }
+        }
+
+        if (std::all_of(keys.begin(), keys.end(), [](KeyCode key) { return key <= 0xFF; }))
+        {
+            keyChars.assign(keys.begin(), keys.end());
+        }
+    }
+
+    /*
+    Builds the table through the virtual ChessPiece interface, which
+    precomputes the full reachable set of every position once.
+    */
+    void Build(const KeyboardLayout& keyboardLayout, const ChessPiece* chessPiecePtr, const KeyPredicate& isVowel)
+    {
+        Build(keyboardLayout, [chessPiecePtr](int x, int y, const KeyboardLayout& layout, auto emit)
+        {
+            for (const auto& [moveX, moveY] : chessPiecePtr->GetReachableMoves(x, y, layout))
+            {
+                emit(moveX, moveY);
+            }
+        }, isVowel);
+    }
+
+    /* Builds the table for a chess-piece known at compile time. */
+    template<typename Piece>
+    void Build(const KeyboardLayout& keyboardLayout, const StaticChessPiece<Piece>*, const KeyPredicate& isVowel)
+    {
+        Build(keyboardLayout, [](int x, int y, const KeyboardLayout& layout, auto emit)
+        {
+            for (const auto& [moveX, moveY] : Piece::MOVES)
+            {
+                if (StaticChessPiece<Piece>::IsValidStaticMove(x, y, moveX, moveY, layout))
+                {
+                    emit(moveX, moveY);
+                }
+            }
+        }, isVowel);
+    }
+
+    /*
+    Patches the table after cells of its layout were edited, given the
+    dirty cells, i.e. the edited cells and the cells depending on them.
+    Only the moves of the dirty cells are visited again, and only the
+    moves that appeared or disappeared are patched into the incoming
+    moves of their destinations. The keys keep their indices, except that
+    a new valid cell is indexed after the others and the last key takes
+    the index of a blanked cell; the enumerators and rankers start in cell
+    order, see GetKeysInCellOrder(), so their orders are still those of a
+    table built afresh. A row that outgrows its
+    room moves to the end of its array with as much room again, and the
+    arrays are packed again once they are mostly room and holes, so an
+    edit costs about the number of moves it changes.
+    */
+    void Update(const KeyboardLayout& layout, vector<Coordinates> dirtyCells, const ChessPiece* chessPiecePtr, const KeyPredicate& isVowel)
+    {
+        const int COLS = layout.GetCols();
+        std::sort(dirtyCells.begin(), dirtyCells.end());
+        dirtyCells.erase(std::unique(dirtyCells.begin(), dirtyCells.end()), dirtyCells.end());
+        if (limits.size() != keys.size())
+        {
+            limits = ends;
+        }
+        if (incomingLimits.size() != keys.size())
+        {
+            incomingLimits = incomingEnds;
+        }
+
+        /*
+        Keeps the moves of the dirty keys that remain valid, and the cells
+        they newly reach. The cells reached by dirty key d are marked 2d,
+        and 2d + 1 once found among its current moves.
+        */
+        vector<int> cellMarks(cellKeys.size(), -1);
+        vector<vector<Coordinates>> reachableMoves(dirtyCells.size());
+        vector<vector<int>> addedCells(dirtyCells.size());
+        vector<pair<int, int>> removedMoves;
+        for (size_t d = 0; d < dirtyCells.size(); ++d)
+        {
+            const auto& [x, y] = dirtyCells[d];
+            const int mark = 2 * d;
+            if (layout.IsValidKey(x, y))
+            {
+                reachableMoves[d] = chessPiecePtr->GetReachableMoves(x, y, layout);
+                for (const auto& [moveX, moveY] : reachableMoves[d])
+                {
+                    cellMarks[(x + moveX) * COLS + y + moveY] = mark;
+                }
+            }
+
+            const int key = cellKeys[x * COLS + y];
+            if (key >= 0)
+            {
+                int kept = offsets[key];
+                for (int i = offsets[key]; i < ends[key]; ++i)
+                {
+                    int& cellMark = cellMarks[positions[moves[i].key].first * COLS + positions[moves[i].key].second];
+                    if (mark == cellMark)
+                    {
+                        moves[kept++] = moves[i];
+                        cellMark = mark + 1;
+                    }
+                    else
+                    {
+                        removedMoves.push_back({moves[i].key, key});
+                    }
+                }
+                ends[key] = kept;
+            }
+
+            for (const auto& [moveX, moveY] : reachableMoves[d])
+            {
+                const int cell = (x + moveX) * COLS + y + moveY;
+                if (mark == cellMarks[cell])
+                {
+                    addedCells[d].push_back(cell);
+                }
+            }
+        }
+        RemoveIncomingMoves(removedMoves);
+
+        for (const auto& [x, y] : dirtyCells)
+        {
+            const int key = cellKeys[x * COLS + y];
+            if (!layout.IsValidKey(x, y))
+            {
+                if (key >= 0)
+                {
+                    RemoveKey(key, COLS);
+                }
+            }
+            else if (key < 0)
+            {
+                AddKey(x, y, COLS, layout.GetKey(x, y), isVowel);
+            }
+            else
+            {
+                SetKey(key, layout.GetKey(x, y), isVowel);
+            }
+        }
+
+        if ((keyChars.size() != keys.size()) && std::all_of(keys.begin(), keys.end(), [](KeyCode key) { return key <= 0xFF; }))
+        {
+            keyChars.assign(keys.begin(), keys.end());
+        }
+
+        /* Rewrites the dirty rows in the order of the chess-piece moves, as Build() does */
+        vector<pair<int, KeyMove>> addedMoves;
+        for (size_t d = 0; d < dirtyCells.size(); ++d)
+        {
+            const auto& [x, y] = dirtyCells[d];
+            const int key = cellKeys[x * COLS + y];
+            if (key < 0)
+            {
+                continue;
+            }
+
+            ReserveRow(moves, offsets, ends, limits, key, static_cast<int>(reachableMoves[d].size()) - (ends[key] - offsets[key]));
+            ends[key] = offsets[key];
+            for (const auto& [moveX, moveY] : reachableMoves[d])
+            {
+                const int newKey = cellKeys[(x + moveX) * COLS + y + moveY];
+                moves[ends[key]++] = {newKey, vowels[newKey]};
+            }
+
+            for (int cell : addedCells[d])
+            {
+                addedMoves.push_back({cellKeys[cell], {key, vowels[cellKeys[cell]]}});
+            }
+        }
+        AddIncomingMoves(addedMoves);
+
+        PackRows(moves, offsets, ends, limits);
+        PackRows(incomingMoves, incomingOffsets, incomingEnds, incomingLimits);
+    }
+
+    /*
+    Returns the table of the reversed move graph, i.e. with the moves and
+    the incoming moves swapped, so that the DP step kernel run over it
+    counts sequences backwards from their last key.
+    */
+    KeyMoveTable GetReversed() const
+    {
+        KeyMoveTable reversed = *this;
+        std::swap(reversed.offsets, reversed.incomingOffsets);
+        std::swap(reversed.ends, reversed.incomingEnds);
+        std::swap(reversed.limits, reversed.incomingLimits);
+        std::swap(reversed.moves, reversed.incomingMoves);
+        for (int key = 0; key < GetKeyCount(); ++key)
+        {
+            for (int i = reversed.offsets[key]; i < reversed.ends[key]; ++i)
+            {
+                reversed.moves[i].vowel = vowels[reversed.moves[i].key];
+            }
+        }
+
+        return reversed;
+    }
+
+    /*
+    Returns the same table with its keys renumbered so that newKey is the
+    key order[newKey] of this table. The incoming moves are renumbered as
+    they are rather than transposed again, as those of a KeySymmetry orbit
+    table are not the transpose of its moves; every row of them is sorted
+    by source key so that the step kernel reads its sources in order.
+    */
+    KeyMoveTable GetRenumbered(const vector<int>& order) const
+    {
+        const int KEYS = GetKeyCount();
+        vector<int> newKeys(KEYS);
+        for (int newKey = 0; newKey < KEYS; ++newKey)
+        {
+            newKeys[order[newKey]] = newKey;
+        }
+
+        KeyMoveTable renumbered;
+        for (int key : order)
+        {
+            renumbered.offsets.push_back(renumbered.moves.size());
+            renumbered.keys.push_back(keys[key]);
+            renumbered.positions.push_back(positions[key]);
+            renumbered.vowels.push_back(vowels[key]);
+            if (!keyChars.empty())
+            {
+                renumbered.keyChars.push_back(keyChars[key]);
+            }
+
+            for (const auto& move : GetMoves(key))
+            {
+                renumbered.moves.push_back({newKeys[move.key], move.vowel});
+            }
+            renumbered.ends.push_back(renumbered.moves.size());
+
+            renumbered.incomingOffsets.push_back(renumbered.incomingMoves.size());
+            for (const auto& move : GetIncomingMoves(key))
+            {
+                renumbered.incomingMoves.push_back({newKeys[move.key], move.vowel});
+            }
+            std::sort(renumbered.incomingMoves.begin() + renumbered.incomingOffsets.back(), renumbered.incomingMoves.end(),
+                      [](const KeyMove& lhs, const KeyMove& rhs) { return lhs.key < rhs.key; });
+            renumbered.incomingEnds.push_back(renumbered.incomingMoves.size());
+        }
+
+        renumbered.cellKeys = cellKeys;
+        for (int& cellKey : renumbered.cellKeys)
+        {
+            if (cellKey >= 0)
+            {
+                cellKey = newKeys[cellKey];
+            }
+        }
+
+        return renumbered;
+    }
+
+    /*
+    Returns the table with its keys ordered tile by tile, every tile being
+    a tileSize x tileSize block of the layout in row-major order, so that
+    the sources of a key mostly lie within a few tiles of it and stay in
+    cache on layouts much wider than a tile.
+    */
+    KeyMoveTable GetTiled(int rows, int cols, int tileSize) const
+    {
+        vector<int> order;
+        order.reserve(GetKeyCount());
+        for (int tileX = 0; tileX < rows; tileX += tileSize)
+        {
+            for (int tileY = 0; tileY < cols; tileY += tileSize)
+            {
+                for (int x = tileX; x < std::min(tileX + tileSize, rows); ++x)
+                {
+                    for (int y = tileY; y < std::min(tileY + tileSize, cols); ++y)
+                    {
+                        if (cellKeys[x * cols + y] >= 0)
+                        {
+                            order.push_back(cellKeys[x * cols + y]);
+                        }
+                    }
+                }
+            }
+        }
+
+        return GetRenumbered(order);
+    }
+
+    /* Groups the moves by destination key (a CSR transpose). */
+    void SetIncomingMoves()
+    {
+        const int KEYS = GetKeyCount();
+        incomingEnds.assign(KEYS, 0);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            for (const auto& move : GetMoves(key))
+            {
+                incomingEnds[move.key]++;
+            }
+        }
+
+        int incomingCount = 0;
+        incomingOffsets.assign(KEYS, 0);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            incomingOffsets[key] = incomingCount;
+            incomingCount += incomingEnds[key];
+            incomingEnds[key] = incomingOffsets[key];
+        }
+
+        incomingMoves.resize(incomingCount);
+        incomingLimits.clear();
+        for (int key = 0; key < KEYS; ++key)
+        {
+            for (const auto& move : GetMoves(key))
+            {
+                incomingMoves[incomingEnds[move.key]++] = {key, move.vowel};
+            }
+        }
+    }
+
+private:
+    /* Returns the index of the move to or from the given key in a row of the given moves. */
+    static int FindMove(const vector<KeyMove>& rowMoves, int first, int last, int key)
+    {
+        return std::find_if(rowMoves.begin() + first, rowMoves.begin() + last, [key](const KeyMove& move) { return move.key == key; }) - rowMoves.begin();
+    }
+
+    /* Makes room for extra moves in a row, moving it to the end of the moves with as much room again if needed. */
+    static void ReserveRow(vector<KeyMove>& rowMoves, vector<int>& rowOffsets, vector<int>& rowEnds, vector<int>& rowLimits, int row, int extra)
+    {
+        if (rowEnds[row] + extra <= rowLimits[row])
+        {
+            return;
+        }
+
+        const int size = rowEnds[row] - rowOffsets[row];
+        const int offset = rowMoves.size();
+        rowMoves.resize(offset + 2 * (size + extra));
+        std::copy(rowMoves.begin() + rowOffsets[row], rowMoves.begin() + rowEnds[row], rowMoves.begin() + offset);
+        rowOffsets[row] = offset;
+        rowEnds[row] = offset + size;
+        rowLimits[row] = rowMoves.size();
+    }
+
+    /* Packs the rows back to back once fewer than a third of the moves are used. */
+    static void PackRows(vector<KeyMove>& rowMoves, vector<int>& rowOffsets, vector<int>& rowEnds, vector<int>& rowLimits)
+    {
+        size_t size = 0;
+        for (size_t row = 0; row < rowOffsets.size(); ++row)
+        {
+            size += rowEnds[row] - rowOffsets[row];
+        }
+
+        if (rowMoves.size() <= 3 * size)
+        {
+            return;
+        }
+
+        vector<KeyMove> packed;
+        packed.reserve(size);
+        for (size_t row = 0; row < rowOffsets.size(); ++row)
+        {
+            const int offset = packed.size();
+            packed.insert(packed.end(), rowMoves.begin() + rowOffsets[row], rowMoves.begin() + rowEnds[row]);
+            rowOffsets[row] = offset;
+            rowEnds[row] = rowLimits[row] = packed.size();
+        }
+        rowMoves = std::move(packed);
+    }
+
+    /* Drops the given (destination, source) pairs from the incoming moves, one pass per destination. */
+    void RemoveIncomingMoves(vector<pair<int, int>>& removedMoves)
+    {
+        std::sort(removedMoves.begin(), removedMoves.end());
+        for (auto group = removedMoves.begin(); group != removedMoves.end();)
+        {
+            const int key = group->first;
+            const auto groupEnd = std::find_if(group, removedMoves.end(), [key](const pair<int, int>& move) { return move.first != key; });
+            int kept = incomingOffsets[key];
+            for (int i = incomingOffsets[key]; i < incomingEnds[key]; ++i)
+            {
+                if (!std::binary_search(group, groupEnd, pair<int, int>(key, incomingMoves[i].key)))
+                {
+                    incomingMoves[kept++] = incomingMoves[i];
+                }
+            }
+
+            incomingEnds[key] = kept;
+            group = groupEnd;
+        }
+    }
+
+    /* Appends the given incoming moves to the rows of their destinations. */
+    void AddIncomingMoves(vector<pair<int, KeyMove>>& addedMoves)
+    {
+        std::sort(addedMoves.begin(), addedMoves.end(), [](const pair<int, KeyMove>& lhs, const pair<int, KeyMove>& rhs) { return lhs.first < rhs.first; });
+        for (auto group = addedMoves.begin(); group != addedMoves.end();)
+        {
+            const int key = group->first;
+            const auto groupEnd = std::find_if(group, addedMoves.end(), [key](const pair<int, KeyMove>& move) { return move.first != key; });
+            ReserveRow(incomingMoves, incomingOffsets, incomingEnds, incomingLimits, key, groupEnd - group);
+            for (; group != groupEnd; ++group)
+            {
+                incomingMoves[incomingEnds[key]++] = group->second;
+            }
+        }
+    }
+
+    /* Indexes a new valid cell after the other keys, with no moves yet. */
+    void AddKey(int x, int y, int cols, KeyCode key, const KeyPredicate& isVowel)
+    {
+        cellKeys[x * cols + y] = keys.size();
+        if (keyChars.size() == keys.size())
+        {
+            keyChars.push_back(static_cast<char>(key));
+        }
+        keys.push_back(key);
+        positions.push_back({x, y});
+        vowels.push_back(isVowel(key) ? 1 : 0);
+        offsets.push_back(moves.size());
+        ends.push_back(moves.size());
+        limits.push_back(moves.size());
+        incomingOffsets.push_back(incomingMoves.size());
+        incomingEnds.push_back(incomingMoves.size());
+        incomingLimits.push_back(incomingMoves.size());
+        if (key > 0xFF)
+        {
+            keyChars.clear();
+        }
+    }
+
+    /* Drops a key left without moves, the last key taking its index. */
+    void RemoveKey(int key, int cols)
+    {
+        const int last = GetKeyCount() - 1;
+        cellKeys[positions[key].first * cols + positions[key].second] = -1;
+        if (key != last)
+        {
+            keys[key] = keys[last];
+            positions[key] = positions[last];
+            vowels[key] = vowels[last];
+            offsets[key] = offsets[last];
+            ends[key] = ends[last];
+            limits[key] = limits[last];
+            incomingOffsets[key] = incomingOffsets[last];
+            incomingEnds[key] = incomingEnds[last];
+            incomingLimits[key] = incomingLimits[last];
+            if (!keyChars.empty())
+            {
+                keyChars[key] = keyChars[last];
+            }
+
+            cellKeys[positions[key].first * cols + positions[key].second] = key;
+            for (const auto& move : GetMoves(key))
+            {
+                incomingMoves[FindMove(incomingMoves, incomingOffsets[move.key], incomingEnds[move.key], last)].key = key;
+            }
+            for (const auto& move : GetIncomingMoves(key))
+            {
+                moves[FindMove(moves, offsets[move.key], ends[move.key], last)].key = key;
+            }
+        }
+
+        keys.pop_back();
+        positions.pop_back();
+        vowels.pop_back();
+        offsets.pop_back();
+        ends.pop_back();
+        limits.pop_back();
+        incomingOffsets.pop_back();
+        incomingEnds.pop_back();
+        incomingLimits.pop_back();
+        if (!keyChars.empty())
+        {
+            keyChars.pop_back();
+        }
+    }
+
+    /* Renames a key, patching its vowel flag into the moves to and from it. */
+    void SetKey(int key, KeyCode newKey, const KeyPredicate& isVowel)
+    {
+        keys[key] = newKey;
+        if (!keyChars.empty())
+        {
+            keyChars[key] = static_cast<char>(newKey);
+        }
+        if (newKey > 0xFF)
+        {
+            keyChars.clear();
+        }
+
+        const unsigned int vowel = isVowel(newKey) ? 1 : 0;
+        if (vowel == vowels[key])
+        {
+            return;
+        }
+
+        vowels[key] = vowel;
+        for (int i = incomingOffsets[key]; i < incomingEnds[key]; ++i)
+        {
+            incomingMoves[i].vowel = vowel;
+            const int source = incomingMoves[i].key;
+            moves[FindMove(moves, offsets[source], ends[source], key)].vowel = vowel;
+        }
+    }
+};
+
+/*
+Symmetries of the move graph of a KeyMoveTable. The candidates are the
+symmetries of the grid (the mirrors and the half turn, plus the quarter
+turns and diagonal mirrors of a square grid); a candidate is kept when it
+maps every valid key to a valid key with the same vowel flag and the
+moves of every key onto the moves of its image. Candidates are rejected
+on the valid cells, vowel flags and degrees first, and the moves are
+then compared in O(moves) without allocating. Start keys in the same
+orbit then have the same number of sequences, and since the all-ones
+start is symmetric so is every DP level, which therefore only needs one
+state per orbit. A symmetry that fails on a single vowel is dropped, so
+layouts such as the shipped one, whose mirror swaps a vowel with a
+consonant, get no reduction.
+*/
+struct KeySymmetry
+{
+    /* Key permutations preserving the moves and the vowel flags, the identity first */
+    vector<vector<int>> automorphisms;
+    /* Orbit of every key, and the representative (its smallest key) and size of every orbit */
+    vector<int> keyOrbits;
+    vector<int> representatives;
+    vector<uint64_t> orbitSizes;
+    /*
+    Move table over the orbits, each standing for its representative: the
+    incoming moves of an orbit are those of its representative, with the
+    sources replaced by their orbits, so the DP step kernel runs on it.
+    */
+    KeyMoveTable orbitMoves;
+
+    bool IsTrivial() const
+    {
+        return automorphisms.size() <= 1;
+    }
+
+    /* Image of a cell under one of the 8 symmetries of the grid, the last 4 only for square grids. */
+    static Coordinates Transform(int transform, int x, int y, int rows, int cols)
+    {
+        switch (transform)
+        {
+            case 0: return {x, y};
+            case 1: return {x, cols - 1 - y};
+            case 2: return {rows - 1 - x, y};
+            case 3: return {rows - 1 - x, cols - 1 - y};
+            case 4: return {y, x};
+            case 5: return {rows - 1 - y, rows - 1 - x};
+            case 6: return {y, rows - 1 - x};
+            default: return {rows - 1 - y, x};
+        }
+    }
+
+    void Build(const KeyMoveTable& table, int rows, int cols)
+    {
+        const int KEYS = table.GetKeyCount();
+        const int TRANSFORMS = (rows == cols) ? 8 : 4;
+        /* marks[key] is the last key whose image's moves lead to key */
+        vector<int> marks(KEYS, -1);
+        vector<int> permutation(KEYS, -1);
+
+        /* The identity first, which needs no check */
+        for (int key = 0; key < KEYS; ++key)
+        {
+            permutation[key] = key;
+        }
+        automorphisms.push_back(permutation);
+
+        for (int transform = 1; transform < TRANSFORMS; ++transform)
+        {
+            /* Rejects most candidates on the valid cells, vowel flags and degrees alone */
+            bool valid = true;
+            for (int key = 0; (key < KEYS) && valid; ++key)
+            {
+                const auto [x, y] = Transform(transform, table.positions[key].first, table.positions[key].second, rows, cols);
+                const int image = table.cellKeys[x * cols + y];
+                valid = (image >= 0) && (table.vowels[image] == table.vowels[key]) &&
+                        (table.GetMoves(image).size() == table.GetMoves(key).size()) &&
+                        (table.GetIncomingMoves(image).size() == table.GetIncomingMoves(key).size());
+                permutation[key] = image;
+            }
+
+            /* The degrees match, so the moves match if every mapped move is a move of the image */
+            std::fill(marks.begin(), marks.end(), -1);
+            for (int key = 0; (key < KEYS) && valid; ++key)
+            {
+                for (const auto& move : table.GetMoves(permutation[key]))
+                {
+                    marks[move.key] = key;
+                }
+                for (const auto& move : table.GetMoves(key))
+                {
+                    valid = valid && (marks[permutation[move.key]] == key);
+                }
+            }
+
+            if (valid)
+            {
+                automorphisms.push_back(permutation);
+            }
+        }
+
+        /* The automorphisms found form a group, so the images of a key are its orbit */
+        keyOrbits.assign(KEYS, -1);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (keyOrbits[key] >= 0)
+            {
+                continue;
+            }
+
+            representatives.push_back(key);
+            orbitSizes.push_back(0);
+            for (const auto& permutation : automorphisms)
+            {
+                if (keyOrbits[permutation[key]] < 0)
+                {
+                    keyOrbits[permutation[key]] = representatives.size() - 1;
+                    orbitSizes.back()++;
+                }
+            }
+        }
+
+        /* Without a reduction the counting engines run on the table itself */
+        orbitMoves = KeyMoveTable();
+        if (IsTrivial())
+        {
+            return;
+        }
+
+        orbitMoves.cellKeys.assign(rows * cols, -1);
+        for (int key : representatives)
+        {
+            orbitMoves.cellKeys[table.positions[key].first * cols + table.positions[key].second] = orbitMoves.keys.size();
+            orbitMoves.keys.push_back(table.keys[key]);
+            orbitMoves.positions.push_back(table.positions[key]);
+            orbitMoves.vowels.push_back(table.vowels[key]);
+            if (!table.keyChars.empty())
+            {
+                orbitMoves.keyChars.push_back(table.keyChars[key]);
+            }
+
+            orbitMoves.offsets.push_back(orbitMoves.moves.size());
+            orbitMoves.incomingOffsets.push_back(orbitMoves.incomingMoves.size());
+            for (const auto& move : table.GetMoves(key))
+            {
+                orbitMoves.moves.push_back({keyOrbits[move.key], move.vowel});
+            }
+            for (const auto& move : table.GetIncomingMoves(key))
+            {
+                orbitMoves.incomingMoves.push_back({keyOrbits[move.key], move.vowel});
+            }
+
+            orbitMoves.ends.push_back(orbitMoves.moves.size());
+            orbitMoves.incomingEnds.push_back(orbitMoves.incomingMoves.size());
+        }
+    }
+};
+
+/*
+Number of counts per key in the count vectors of the DP engine. Each key
+holds maxVowelCount + 1 counts, padded to a whole number of SIMD registers
+for uint64_t so the step kernel below can use full-width loads.
+*/
+#if defined(__AVX2__)
+constexpr size_t SIMD_COUNT_LANES = 4;
+#elif defined(__ARM_NEON)
+constexpr size_t SIMD_COUNT_LANES = 2;
+#else
+constexpr size_t SIMD_COUNT_LANES = 1;
+#endif
+
+template<typename CountType>
+size_t GetCountStride(unsigned int vowelStates)
+{
+    return vowelStates;
+}
+
+template<>
+inline size_t GetCountStride<uint64_t>(unsigned int vowelStates)
+{
+    return (vowelStates + SIMD_COUNT_LANES - 1) / SIMD_COUNT_LANES * SIMD_COUNT_LANES;
+}
+
+/*
+One level of the counting DP, as a sparse matrix-vector product over the
+incoming moves: a key ending a sequence with v vowels is reached from any
+of its sources ending with v - vowel(key) vowels. Only the destination
+keys in [firstKey, lastKey) are written, so disjoint key ranges can be
+stepped concurrently. This is the portable scalar version used for every
+count type.
+*/
+template<typename CountType>
+void CountSequencesStep(const KeyMoveTable& table, unsigned int vowelStates, size_t stride,
+                        const CountType* counts, CountType* nextCounts, int firstKey, int lastKey)
+{
+    for (int key = firstKey; key < lastKey; ++key)
+    {
+        const unsigned int addedVowels = table.vowels[key];
+        CountType* next = nextCounts + key * stride;
+        std::fill(next, next + stride, CountType(0));
+
+        for (const auto& move : table.GetIncomingMoves(key))
+        {
+            const CountType* current = counts + move.key * stride;
+
+            /* Drops the states that would exceed the vowel limit */
+            for (unsigned int v = 0; v + addedVowels < vowelStates; ++v)
+            {
+                next[v + addedVowels] += current[v];
+            }
+        }
+    }
+}
+
+/*
+The uint64_t version sums the whole (padded) count vector of every source
+with SIMD additions, and applies the vowel shift of the destination once
+per key when storing the sum.
+*/
+template<>
+inline void CountSequencesStep<uint64_t>(const KeyMoveTable& table, unsigned int vowelStates, size_t stride,
+                                         const uint64_t* counts, uint64_t* nextCounts, int firstKey, int lastKey)
+{
+    vector<uint64_t> sum(stride, 0);
+
+    for (int key = firstKey; key < lastKey; ++key)
+    {
+        const KeyMoveRange sources = table.GetIncomingMoves(key);
+
+        for (size_t lane = 0; lane < stride; lane += SIMD_COUNT_LANES)
+        {
+#if defined(__AVX2__)
+            __m256i accumulator = _mm256_setzero_si256();
+            for (const auto& move : sources)
+            {
+                accumulator = _mm256_add_epi64(accumulator, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts + move.key * stride + lane)));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(sum.data() + lane), accumulator);
+#elif defined(__ARM_NEON)
+            uint64x2_t accumulator = vdupq_n_u64(0);
+            for (const auto& move : sources)
+            {
+                accumulator = vaddq_u64(accumulator, vld1q_u64(counts + move.key * stride + lane));
+            }
+            vst1q_u64(sum.data() + lane, accumulator);
+#else
+            uint64_t accumulator = 0;
+            for (const auto& move : sources)
+            {
+                accumulator += counts[move.key * stride + lane];
+            }
+            sum[lane] = accumulator;
+#endif
+        }
+
+        /* Shifts by the vowel of the destination, dropping the states beyond the limit */
+        const unsigned int addedVowels = table.vowels[key];
+        uint64_t* next = nextCounts + key * stride;
+        std::fill(next, next + stride, 0);
+        for (unsigned int v = 0; v + addedVowels < vowelStates; ++v)
+        {
+            next[v + addedVowels] = sum[v];
+        }
+    }
+}
+
+/*
+Counts the sequences of many move tables at once, e.g. for a sweep over
+candidate layouts. The incoming moves of all the added tables are packed
+into one flat CSR matrix whose rows are the (table, key) pairs, so every
+DP level is a single batched sparse matrix-vector product over all the
+tables. Built for offload the matrix is mapped to the device once, all
+the levels run there and only the final counts come back; batches below
+OFFLOAD_MIN_STATES stay on the host, where the transfers would dominate.
+Counts are uint64_t, the type the device kernel works on.
+*/
+class BatchedSequenceCounter
+{
+private:
+    static constexpr size_t OFFLOAD_MIN_STATES = 1 << 12;
+
+    /* The first row of every table, and the total row count at the end */
+    vector<int> tableRows = {0};
+    vector<int> incomingOffsets = {0};
+    /* The source row of every incoming move */
+    vector<int> sources;
+    vector<unsigned int> vowels;
+public:
+    /* Adds a table to the batch, returning its index in the results. */
+    size_t Add(const KeyMoveTable& table)
+    {
+        const int FIRST_ROW = tableRows.back();
+        for (int key = 0; key < table.GetKeyCount(); ++key)
+        {
+            for (const auto& move : table.GetIncomingMoves(key))
+            {
+                sources.push_back(FIRST_ROW + move.key);
+            }
+            incomingOffsets.push_back(sources.size());
+            vowels.push_back(table.vowels[key]);
+        }
+
+        tableRows.push_back(FIRST_ROW + table.GetKeyCount());
+        return tableRows.size() - 2;
+    }
+
+    size_t GetTableCount() const
+    {
+        return tableRows.size() - 1;
+    }
+
+    /* Returns the number of sequences of every table, in the order they were added. */
+    vector<uint64_t> CountSequences(unsigned int sequenceLength, unsigned int maxVowelCount) const
+    {
+        if (0 == sequenceLength)
+        {
+            throw invalid_argument("Sequence length must be non-zero.");
+        }
+
+        const int ROWS = tableRows.back();
+        const int VOWEL_STATES = maxVowelCount + 1;
+        const size_t STATES = static_cast<size_t>(ROWS) * VOWEL_STATES;
+        const size_t MOVES = sources.size();
+        vector<uint64_t> counts(STATES, 0);
+        vector<uint64_t> nextCounts(STATES, 0);
+
+        const int* incoming = incomingOffsets.data();
+        const int* source = sources.data();
+        const unsigned int* vowel = vowels.data();
+        uint64_t* current = counts.data();
+        uint64_t* next = nextCounts.data();
+        const bool offload = STATES >= OFFLOAD_MIN_STATES;
+        (void)offload;
+        (void)MOVES;
+
+        CHESS_CHALLENGE_OFFLOAD_PRAGMA("omp target data if(offload) map(to: incoming[0:ROWS + 1], source[0:MOVES], vowel[0:ROWS]) map(alloc: next[0:STATES]) map(tofrom: current[0:STATES])")
+        {
+            CHESS_CHALLENGE_OFFLOAD_PRAGMA("omp target teams distribute parallel for if(offload)")
+            for (int row = 0; row < ROWS; ++row)
+            {
+                for (int v = 0; v < VOWEL_STATES; ++v)
+                {
+                    current[static_cast<size_t>(row) * VOWEL_STATES + v] = (static_cast<int>(vowel[row]) == v) ? 1 : 0;
+                }
+            }
+
+            for (unsigned int position = 1; position < sequenceLength; ++position)
+            {
+                CHESS_CHALLENGE_OFFLOAD_PRAGMA("omp target teams distribute parallel for if(offload)")
+                for (int row = 0; row < ROWS; ++row)
+                {
+                    const int addedVowels = vowel[row];
+                    uint64_t* nextRow = next + static_cast<size_t>(row) * VOWEL_STATES;
+                    for (int v = 0; v < VOWEL_STATES; ++v)
+                    {
+                        nextRow[v] = 0;
+                    }
+
+                    /* Drops the states that would exceed the vowel limit */
+                    for (int move = incoming[row]; move < incoming[row + 1]; ++move)
+                    {
+                        const uint64_t* sourceRow = current + static_cast<size_t>(source[move]) * VOWEL_STATES;
+                        for (int v = 0; v + addedVowels < VOWEL_STATES; ++v)
+                        {
+                            nextRow[v + addedVowels] += sourceRow[v];
+                        }
+                    }
+                }
+
+                std::swap(current, next);
+            }
+
+            /* The counts end up in whichever buffer the last level wrote */
+            CHESS_CHALLENGE_OFFLOAD_PRAGMA("omp target update if(offload) from(current[0:STATES])")
+        }
+
+        vector<uint64_t> results(GetTableCount(), 0);
+        for (size_t table = 0; table < results.size(); ++table)
+        {
+            for (size_t state = static_cast<size_t>(tableRows[table]) * VOWEL_STATES; state < static_cast<size_t>(tableRows[table + 1]) * VOWEL_STATES; ++state)
+            {
+                results[table] += current[state];
+            }
+        }
+
+        return results;
+    }
+
+    /* Counts the sequences of many layouts for one chess-piece. */
+    static vector<uint64_t> CountSequences(const vector<KeyboardLayout>& keyboardLayouts, const ChessPiece* chessPiecePtr,
+                                           unsigned int sequenceLength, unsigned int maxVowelCount, const KeyPredicate& isVowelPredicate = IsVowelKey)
+    {
+        BatchedSequenceCounter counter;
+        for (const auto& keyboardLayout : keyboardLayouts)
+        {
+            KeyMoveTable table;
+            table.Build(keyboardLayout, chessPiecePtr, isVowelPredicate);
+            counter.Add(table);
+        }
+
+        return counter.CountSequences(sequenceLength, maxVowelCount);
+    }
+};
+
+/*
+Counters of a Keyboard run, only filled when compiled with
+-DCHESS_CHALLENGE_STATS. A node is a partial sequence expanded by the BFS
+or the DFS, and a vowel prune a valid move dropped because it would
+exceed the vowel limit. The queue high-water mark is the largest single
+BFS level, and the bytes allocated are counted process-wide during the
+run. The precompute time covers the move table and bitboards, the
+traversal time the run itself.
+*/
+struct TraversalStats
+{
+    uint64_t nodesExpanded = 0;
+    uint64_t prunedByVowel = 0;
+    uint64_t queueHighWaterMark = 0;
+    uint64_t bytesAllocated = 0;
+    uint64_t precomputeNanoseconds = 0;
+    uint64_t traversalNanoseconds = 0;
+
+    /* Adds the counters of a traversal run concurrently with this one. */
+    void Merge(const TraversalStats& other)
+    {
+        nodesExpanded += other.nodesExpanded;
+        prunedByVowel += other.prunedByVowel;
+        queueHighWaterMark = std::max(queueHighWaterMark, other.queueHighWaterMark);
+    }
+
+    vector<pair<string, uint64_t>> GetFields() const
+    {
+        return {{"nodes_expanded", nodesExpanded},
+                {"pruned_by_vowel", prunedByVowel},
+                {"queue_high_water_mark", queueHighWaterMark},
+                {"bytes_allocated", bytesAllocated},
+                {"precompute_nanoseconds", precomputeNanoseconds},
+                {"traversal_nanoseconds", traversalNanoseconds}};
+    }
+
+    string ToJson() const
+    {
+        string json = "{";
+        for (const auto& [name, value] : GetFields())
+        {
+            json += (json.size() > 1 ? ", \"" : "\"") + name + "\": " + std::to_string(value);
+        }
+
+        return json + "}";
+    }
+
+    /* Prometheus text exposition format, one gauge per counter. */
+    string ToPrometheus() const
+    {
+        string text;
+        for (const auto& [name, value] : GetFields())
+        {
+            text += "# TYPE chess_challenge_" + name + " gauge\n";
+            text += "chess_challenge_" + name + " " + std::to_string(value) + "\n";
+        }
+
+        return text;
+    }
+};
+
+/*
+Per-key breakdown of the number of sequences, computed by the dynamic
+programming without materializing any sequence. Counts are indexed like
+the keys of the move table; the start x end matrix is only filled when
+requested, as startEnd[start * keys.size() + end].
+*/
+template<typename CountType>
+struct SequenceBreakdown
+{
+    vector<KeyCode> keys;
+    vector<CountType> perStartKey;
+    vector<CountType> perEndKey;
+    vector<CountType> startEnd;
+};
+
+/*
+Ranks and unranks the valid sequences of a move table without enumerating
+them. The sequences are ordered as the depth-first enumerator produces
+them: by start cell, then by the move order of every key. The completion
+table holds, for every remaining length and (key, vowels used) state, the
+number of valid ways to finish a partial sequence, so both directions
+walk the sequence once, skipping whole subtrees by their completion
+count, in O(sequenceLength * moves per key). The count type needs < and
+-=, e.g. uint64_t, Count128 or BigCount.
+*/
+template<typename CountType>
+class SequenceRanker
+{
+private:
+    const KeyMoveTable& table;
+    const unsigned int sequenceLength;
+    const unsigned int maxVowelCount;
+    const unsigned int vowelStates;
+    /* completions[(remaining * KEYS + key) * vowelStates + v] */
+    vector<CountType> completions;
+    std::array<int, 256> charKeys;
+    /* The start keys in row-major cell order, see KeyMoveTable::GetKeysInCellOrder() */
+    const vector<int> startKeys;
+    CountType total = CountType(0);
+
+    const CountType& GetCompletions(unsigned int remaining, int key, unsigned int vowels) const
+    {
+        return completions[(static_cast<size_t>(remaining) * table.GetKeyCount() + key) * vowelStates + vowels];
+    }
+public:
+    SequenceRanker(const KeyMoveTable& newTable, unsigned int newSequenceLength, unsigned int newMaxVowelCount)
+        : table(newTable), sequenceLength(newSequenceLength), maxVowelCount(newMaxVowelCount), vowelStates(newMaxVowelCount + 1),
+          startKeys(newTable.GetKeysInCellOrder())
+    {
+        const int KEYS = table.GetKeyCount();
+        if (table.keyChars.size() != table.keys.size())
+        {
+            throw invalid_argument("Sequences can only be ranked for layouts whose keys are chars.");
+        }
+
+        charKeys.fill(-1);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            int& charKey = charKeys[static_cast<unsigned char>(table.keyChars[key])];
+            if (charKey >= 0)
+            {
+                throw invalid_argument("Sequences can only be ranked for layouts without duplicate keys.");
+            }
+            charKey = key;
+        }
+
+        completions.assign(static_cast<size_t>(sequenceLength) * KEYS * vowelStates, CountType(0));
+        for (int key = 0; key < KEYS; ++key)
+        {
+            for (unsigned int v = 0; v < vowelStates; ++v)
+            {
+                completions[key * vowelStates + v] = CountType(1);
+            }
+        }
+
+        for (unsigned int remaining = 1; remaining < sequenceLength; ++remaining)
+        {
+            for (int key = 0; key < KEYS; ++key)
+            {
+                for (unsigned int v = 0; v < vowelStates; ++v)
+                {
+                    CountType& count = completions[(static_cast<size_t>(remaining) * KEYS + key) * vowelStates + v];
+                    for (const auto& move : table.GetMoves(key))
+                    {
+                        if (v + move.vowel <= maxVowelCount)
+                        {
+                            count += GetCompletions(remaining - 1, move.key, v + move.vowel);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (table.vowels[key] <= maxVowelCount)
+            {
+                total += GetCompletions(sequenceLength - 1, key, table.vowels[key]);
+            }
+        }
+    }
+
+    /* Number of valid sequences, i.e. one past the largest rank. */
+    const CountType& GetCount() const
+    {
+        return total;
+    }
+
+    /* Returns the key indices of the sequence of the given rank, in [0, GetCount()). */
+    vector<int> UnrankKeys(CountType rank) const
+    {
+        if (!(rank < total))
+        {
+            throw std::out_of_range("Sequence rank is out of range.");
+        }
+
+        vector<int> keys;
+        unsigned int vowels = 0;
+        for (int start : startKeys)
+        {
+            if (table.vowels[start] > maxVowelCount)
+            {
+                continue;
+            }
+
+            const CountType& count = GetCompletions(sequenceLength - 1, start, table.vowels[start]);
+            if (rank < count)
+            {
+                keys.push_back(start);
+                vowels = table.vowels[start];
+                break;
+            }
+            rank -= count;
+        }
+
+        for (unsigned int remaining = sequenceLength - 1; remaining > 0; --remaining)
+        {
+            for (const auto& move : table.GetMoves(keys.back()))
+            {
+                if (vowels + move.vowel > maxVowelCount)
+                {
+                    continue;
+                }
+
+                const CountType& count = GetCompletions(remaining - 1, move.key, vowels + move.vowel);
+                if (rank < count)
+                {
+                    keys.push_back(move.key);
+                    vowels += move.vowel;
+                    break;
+                }
+                rank -= count;
+            }
+        }
+
+        return keys;
+    }
+
+    /* Returns the sequence of the given rank, in [0, GetCount()). */
+    string Unrank(const CountType& rank) const
+    {
+        string sequence;
+        for (int key : UnrankKeys(rank))
+        {
+            sequence += table.keyChars[key];
+        }
+
+        return sequence;
+    }
+
+    /* Returns the rank of a valid sequence, throwing invalid_argument for any other string. */
+    CountType Rank(std::string_view sequence) const
+    {
+        if (sequence.size() != sequenceLength)
+        {
+            throw invalid_argument("Sequence length does not match the ranker.");
+        }
+
+        int key = charKeys[static_cast<unsigned char>(sequence[0])];
+        if ((key < 0) || (table.vowels[key] > maxVowelCount))
+        {
+            throw invalid_argument("Not a valid sequence: " + string(sequence));
+        }
+
+        CountType rank(0);
+        for (auto start = startKeys.begin(); *start != key; ++start)
+        {
+            if (table.vowels[*start] <= maxVowelCount)
+            {
+                rank += GetCompletions(sequenceLength - 1, *start, table.vowels[*start]);
+            }
+        }
+
+        unsigned int vowels = table.vowels[key];
+        for (unsigned int position = 1; position < sequenceLength; ++position)
+        {
+            const int nextKey = charKeys[static_cast<unsigned char>(sequence[position])];
+            const unsigned int remaining = sequenceLength - 1 - position;
+            bool found = false;
+            for (const auto& move : table.GetMoves(key))
+            {
+                if (vowels + move.vowel > maxVowelCount)
+                {
+                    continue;
+                }
+
+                if (move.key == nextKey)
+                {
+                    found = true;
+                    break;
+                }
+                rank += GetCompletions(remaining, move.key, vowels + move.vowel);
+            }
+
+            if (!found)
+            {
+                throw invalid_argument("Not a valid sequence: " + string(sequence));
+            }
+
+            key = nextKey;
+            vowels += table.vowels[key];
+        }
+
+        return rank;
+    }
+};
+
+/*
+A minimal work-stealing scheduler for a fixed set of independent tasks.
+Every worker owns a deque of tasks, initially dealt out in contiguous
+blocks, and takes work from the back of its own deque; once it runs dry
+it steals from the front of the other workers' deques, so unevenly sized
+tasks still keep all the workers busy.
+*/
+template<typename Task>
+class WorkStealingScheduler
+{
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    vector<std::unique_ptr<WorkerQueue>> queues;
+
+    bool PopOwnTask(unsigned int worker, Task& task)
+    {
+        WorkerQueue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool StealTask(unsigned int worker, Task& task)
+    {
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            WorkerQueue& victim = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+public:
+    explicit WorkStealingScheduler(unsigned int workerCount)
+    {
+        if (0 == workerCount)
+        {
+            throw invalid_argument("Worker count must be non-zero.");
+        }
+
+        for (unsigned int i = 0; i < workerCount; ++i)
+        {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+    }
+
+    /*
+    Runs every task exactly once, the calling thread being one of the
+    workers, and rethrows the first exception raised by any task.
+    */
+    template<typename TaskFunction>
+    void Run(vector<Task> tasks, TaskFunction runTask)
+    {
+        const size_t WORKERS = queues.size();
+        const size_t BLOCK = (tasks.size() + WORKERS - 1) / WORKERS;
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            queues[i / std::max<size_t>(BLOCK, 1)]->tasks.push_back(std::move(tasks[i]));
+        }
+
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+        std::atomic<bool> failed(false);
+
+        auto worker = [&](unsigned int id)
+        {
+            Task task;
+            while (!failed && (PopOwnTask(id, task) || StealTask(id, task)))
+            {
+                try
+                {
+                    runTask(task);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    if (!failure)
+                    {
+                        failure = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+        };
+
+        vector<std::thread> workers;
+        for (unsigned int id = 1; id < WORKERS; ++id)
+        {
+            workers.emplace_back(worker, id);
+        }
+
+        worker(0);
+        for (auto& thread : workers)
+        {
+            thread.join();
+        }
+
+        for (auto& queue : queues)
+        {
+            queue->tasks.clear();
+        }
+
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+    }
+};
+
+/*
+Reusable barrier of a fixed number of threads, which the workers of the
+sparse engine cross once per DP level (std::barrier is C++20).
+*/
+class LevelBarrier
+{
+private:
+    const unsigned int threadCount;
+    unsigned int waiting = 0;
+    uint64_t generation = 0;
+    std::mutex mutex;
+    std::condition_variable released;
+public:
+    explicit LevelBarrier(unsigned int newThreadCount) : threadCount(newThreadCount) {}
+
+    /* Blocks until all the threads have arrived. */
+    void ArriveAndWait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const uint64_t arrival = generation;
+        if (++waiting == threadCount)
+        {
+            waiting = 0;
+            generation++;
+            lock.unlock();
+            released.notify_all();
+            return;
+        }
+
+        released.wait(lock, [this, arrival]() { return generation != arrival; });
+    }
+};
+
+/*
+Smallest DP, in (key, vowels used) states and sequence length, for which
+the counting engines look for symmetries of the move graph: the detection
+scans the moves once per candidate, which smaller DPs do not make up for.
+*/
+constexpr size_t SYMMETRY_MIN_STATES = 1 << 12;
+constexpr unsigned int SYMMETRY_MIN_LENGTH = 8;
+
+/*
+Number of (key, vowels used) states from which DynamicProgramming runs on
+the multithreaded sparse engine, and the tile size of its key ordering.
+*/
+constexpr size_t SPARSE_STATE_THRESHOLD = 1 << 15;
+constexpr int SPARSE_TILE_SIZE = 16;
+
+/*
+The dependencies, i.e. the keyboard layout and the chess-piece are 
+injected to the Keyboard class through the constructor hence this class
+can be reused if the layout and the chess-piece change.
+
+The Keyboard class verifies if the chess-piece move complies to all 
+the constraints and generate unique sequences of the provided length
+for each key as a starting position.
+
+It stores unique sequences in an unordered map.
+
+*/
+class Keyboard
+{
+    friend class KeyboardBenchmark;
+private:
+    /*
+    A partial sequence of the BFS, stored in a per-level arena: its latest
+    key and vowel count, and the index of the partial sequence it extends
+    in the previous level, so that all the extensions of a prefix share it.
+    */
+    struct PrefixNode
+    {
+        int parent;
+        int key;
+        unsigned int vowels;
+    };
+
+    /* A partial sequence whose extensions are enumerated as one task */
+    struct PrefixTask
+    {
+        string prefix;
+        int startKey;
+        int lastKey;
+        unsigned int vowels;
+        size_t slot;
+    };
+
+    /*
+    Scope of one run for the statistics: the outermost run resets the
+    traversal counters and, when it ends, records its time and the bytes
+    allocated meanwhile.
+    */
+    class StatsRun
+    {
+    private:
+        Keyboard& keyboard;
+        const bool outermost;
+        const std::chrono::steady_clock::time_point start;
+        const uint64_t allocatedBytesAtStart;
+    public:
+        explicit StatsRun(Keyboard& newKeyboard)
+            : keyboard(newKeyboard), outermost(!newKeyboard.statsRunning), start(std::chrono::steady_clock::now()),
+              allocatedBytesAtStart(GetAllocatedBytes())
+        {
+            if (outermost)
+            {
+                std::lock_guard<std::mutex> lock(keyboard.statsMutex);
+                const uint64_t precomputeNanoseconds = keyboard.stats.precomputeNanoseconds;
+                keyboard.stats = TraversalStats();
+                keyboard.stats.precomputeNanoseconds = precomputeNanoseconds;
+                keyboard.statsRunning = true;
+            }
+        }
+
+        ~StatsRun()
+        {
+            if (outermost)
+            {
+                std::lock_guard<std::mutex> lock(keyboard.statsMutex);
+                keyboard.stats.traversalNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                keyboard.stats.bytesAllocated = GetAllocatedBytes() - allocatedBytesAtStart;
+                keyboard.statsRunning = false;
+            }
+        }
+
+        static uint64_t GetAllocatedBytes()
+        {
+#if defined(CHESS_CHALLENGE_COUNT_ALLOCATIONS)
+            return allocatedBytes.load(std::memory_order_relaxed);
+#else
+            return 0;
+#endif
+        }
+    };
+
+    const unsigned int sequenceLength = 0;
+    const unsigned int maxVowelCount = 0;
+    const KeyboardLayout& keyboardLayout;
+    const ChessPiece* chessPiecePtr;
+    const KeyPredicate isVowelPredicate;
+    /* Number of threads of the parallel modes, 0 selects the hardware concurrency */
+    unsigned int threadCount = 0;
+    /* Number of keys in the prefix of every work-stealing task */
+    unsigned int prefixDepth = 3;
+    KeyMoveTable keyMoves;
+    /* Version of the layout keyMoves was built for, see ApplyLayoutEdits() */
+    uint64_t layoutVersion = 0;
+    /* Completion tables of Rank() and Unrank(), built on first use; exact below UINT64_MAX, see SaturatingCount */
+    std::unique_ptr<SequenceRanker<SaturatingCount>> ranker;
+    /* Counters of the last run, see TraversalStats */
+    mutable TraversalStats stats;
+    mutable std::mutex statsMutex;
+    bool statsRunning = false;
+    /* Symmetries of keyMoves, built on first use */
+    std::unique_ptr<KeySymmetry> keySymmetry;
+    /* keyMoves ordered tile by tile for the sparse engine, built on first use */
+    KeyMoveTable tiledKeyMoves;
+    /* Bitboard view of the valid moves, only for layouts of at most 64 cells */
+    vector<Bitboard> attackBitboards;
+    vector<Coordinates> bitboardMoves;
+    vector<Bitboard> moveSourceBitboards;
+    Bitboard vowelBitboard = 0;
+
+    /* 
+    Stores all the valid moves of all the keys in the flat move table,
+    through the static path when the chess-piece is a StaticChessPiece.
+    */
+    template<typename ChessPiecePointer>
+    void SetValidMovesForAllKeys(ChessPiecePointer piecePtr)
+    {
+        keyMoves.Build(keyboardLayout, piecePtr, isVowelPredicate);
+    }
+
+    /* Validates the parameters and precomputes the move tables. */
+    template<typename MovePrecompute>
+    void Initialize(MovePrecompute setValidMoves)
+    {
+        try
+        {
+            if(0 == sequenceLength)
+            {
+                throw invalid_argument("Sequence length must be non-zero.");
+            }
+            
+            CHESS_CHALLENGE_STAT(const auto start = std::chrono::steady_clock::now();)
+            setValidMoves();
+            layoutVersion = keyboardLayout.GetVersion();
+
+            if (keyboardLayout.FitsInBitboard())
+            {
+                SetBitboardsForAllKeys();
+            }
+            CHESS_CHALLENGE_STAT(stats.precomputeNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();)
+        } 
+        catch (const exception& e) 
+        {
+            cerr << "Exception during Keyboard initialization: " << e.what() << endl;
+            throw;
+        }
+    }
+    
+    /*
+    Precomputes the bitboards used by the bitboard counting engine: the
+    attack bitboard of every cell and, for every chess-piece move, the
+    set of cells the move is valid from.
+    */
+    void SetBitboardsForAllKeys()
+    {
+        const int COLS = keyboardLayout.GetCols();
+
+        vowelBitboard = 0;
+        bitboardMoves.clear();
+        moveSourceBitboards.clear();
+        attackBitboards = chessPiecePtr->GetAttackBitboards(keyboardLayout);
+
+        /* Derives the distinct move offsets from the table, which covers sliding pieces too */
+        for (int key = 0; key < keyMoves.GetKeyCount(); ++key)
+        {
+            const auto& [x, y] = keyMoves.positions[key];
+            if (keyMoves.vowels[key])
+            {
+                vowelBitboard |= Bitboard(1) << (x * COLS + y);
+            }
+
+            for (const auto& move : GetValidMovesForAKey(key))
+            {
+                const Coordinates offset = {keyMoves.positions[move.key].first - x, keyMoves.positions[move.key].second - y};
+                size_t m = std::find(bitboardMoves.begin(), bitboardMoves.end(), offset) - bitboardMoves.begin();
+                if (m == bitboardMoves.size())
+                {
+                    bitboardMoves.push_back(offset);
+                    moveSourceBitboards.push_back(0);
+                }
+
+                moveSourceBitboards[m] |= Bitboard(1) << (x * COLS + y);
+            }
+        }
+    }
+
+    /* Returns all the cells reachable in one move from any cell of the frontier. */
+    Bitboard ExpandFrontier(Bitboard frontier) const
+    {
+        Bitboard reachable = 0;
+        for (size_t m = 0; m < bitboardMoves.size(); ++m)
+        {
+            reachable |= ShiftBitboard(frontier & moveSourceBitboards[m], bitboardMoves[m].first, bitboardMoves[m].second,
+                                       keyboardLayout.GetRows(), keyboardLayout.GetCols());
+        }
+
+        return reachable;
+    }
+
+    /* Returns all the valid moves for a particular key index. */
+    KeyMoveRange GetValidMovesForAKey(int key) const
+    {
+        return keyMoves.GetMoves(key);
+    }
+
+    /* Fails if the layout was edited since keyMoves was built, for the const queries. */
+    void CheckLayoutIsCurrent() const
+    {
+        if (layoutVersion != keyboardLayout.GetVersion())
+        {
+            throw std::logic_error("The layout was edited, ApplyLayoutEdits() must be called first.");
+        }
+    }
+
+    /* Sequences are strings, so enumerating them needs keys that are chars. */
+    void CheckKeysAreChars() const
+    {
+        if (keyMoves.keyChars.size() != keyMoves.keys.size())
+        {
+            throw invalid_argument("Sequences can only be enumerated for layouts whose keys are chars.");
+        }
+    }
+
+    /* Generate the sequences starting from one key of the keyboard */
+    void GenerateSequencesFromKey(int start, PackedSequences& sequences) const
+    {
+        CheckKeysAreChars();
+
+        /* Starts with a sequence containing only the starting character */
+        GenerateSequencesFromPrefix(string(1, keyMoves.keyChars[start]), start, keyMoves.vowels[start], [&](const string& seq)
+        {
+            sequences.Append(seq);
+        });
+    }
+
+    /*
+    Generate the sequences extending a prefix ending at the given key and
+    containing the given number of vowels, handing each finished sequence
+    to emit. The sequence handed over lives in a buffer reused for every
+    sequence, so emit has to copy whatever it keeps.
+    */
+    template<typename EmitFunction>
+    void GenerateSequencesFromPrefix(const string& prefix, int lastKey, unsigned int prefixVowels, EmitFunction emit) const
+    {
+        /* Skips a prefix that already exceeds the vowel limit */
+        if (prefixVowels > maxVowelCount)
+        {
+            return;
+        }
+
+        string buffer = prefix;
+        if (prefix.size() >= sequenceLength)
+        {
+            emit(buffer);
+            return;
+        }
+
+        CHESS_CHALLENGE_STAT(TraversalStats localStats;)
+        const size_t FIRST = prefix.size();
+        buffer.resize(sequenceLength);
+
+        /*
+        Initiates a breadth-first search(BFS) search for a key
+        to explore all possible sequences starting from it, one
+        level at a time. levels[d] is the arena of the partial
+        sequences of FIRST + d keys; instead of a string, each
+        node only holds its latest key, its vowel count and the
+        index of its parent in levels[d - 1].
+          - Explore all the valid moves from every node of a level
+          - For each valid move:
+            - Skip it if the destination key would exceed the
+              vowel limit; the vowel count is carried along, so
+              this check is O(1).
+            - Add a node for the destination key to the next level,
+              or, on the last level, spell the sequence into the
+              buffer by walking up the parents and emit it.
+        */
+        vector<vector<PrefixNode>> levels(sequenceLength - FIRST);
+        levels[0].push_back({-1, lastKey, prefixVowels});
+        for (size_t depth = 0; depth < levels.size(); ++depth)
+        {
+            const bool lastLevel = (depth + 1 == levels.size());
+            CHESS_CHALLENGE_STAT(localStats.queueHighWaterMark = std::max<uint64_t>(localStats.queueHighWaterMark, levels[depth].size());)
+
+            for (size_t node = 0; node < levels[depth].size(); ++node)
+            {
+                const PrefixNode& current = levels[depth][node];
+                if (lastLevel)
+                {
+                    /* The keys after the prefix, shared by all the extensions of this node */
+                    int index = node;
+                    for (size_t level = depth; level > 0; --level)
+                    {
+                        buffer[FIRST - 1 + level] = keyMoves.keyChars[levels[level][index].key];
+                        index = levels[level][index].parent;
+                    }
+                }
+
+                /* Loops through the valid moves from the current key */
+                CHESS_CHALLENGE_STAT(localStats.nodesExpanded++;)
+                for (const auto& move : GetValidMovesForAKey(current.key))
+                {
+                    if (current.vowels + move.vowel > maxVowelCount)
+                    {
+                        CHESS_CHALLENGE_STAT(localStats.prunedByVowel++;)
+                        continue;
+                    }
+
+                    if (lastLevel)
+                    {
+                        buffer[sequenceLength - 1] = keyMoves.keyChars[move.key];
+                        emit(buffer);
+                    }
+                    else
+                    {
+                        levels[depth + 1].push_back({static_cast<int>(node), move.key, current.vowels + move.vowel});
+                    }
+                }
+            }
+        }
+
+        CHESS_CHALLENGE_STAT(RecordStats(localStats);)
+    }
+
+    /*
+    The iterative depth-first search of EnumerateSequencesDepthFirst(). It
+    streams at most limit sequences starting from the sequence of the
+    given keys, or from the first sequence when no keys are given.
+    */
+    void EnumerateDepthFirst(const vector<int>& firstKeys, uint64_t limit, SequenceSink& sink)
+    {
+        CHESS_CHALLENGE_STAT(TraversalStats localStats;)
+        const int LAST = sequenceLength - 1;
+        string buffer(sequenceLength, '\0');
+        vector<int> keys(sequenceLength);
+        vector<unsigned int> vowels(sequenceLength);
+        vector<const KeyMove*> cursors(sequenceLength);
+        uint64_t emitted = 0;
+
+        /* In cell order, so that the order only depends on the layout, see KeyMoveTable::GetKeysInCellOrder() */
+        const vector<int> startKeys = keyMoves.GetKeysInCellOrder();
+        auto startKey = firstKeys.empty() ? startKeys.begin() : std::find(startKeys.begin(), startKeys.end(), firstKeys[0]);
+        for (; (startKey != startKeys.end()) && (emitted < limit); ++startKey)
+        {
+            const int start = *startKey;
+            if (keyMoves.vowels[start] > maxVowelCount)
+            {
+                continue;
+            }
+
+            buffer[0] = keyMoves.keyChars[start];
+            if (0 == LAST)
+            {
+                sink.Consume(buffer);
+                emitted++;
+                continue;
+            }
+
+            keys[0] = start;
+            vowels[0] = keyMoves.vowels[start];
+            cursors[0] = GetValidMovesForAKey(start).begin();
+            CHESS_CHALLENGE_STAT(localStats.nodesExpanded++;)
+
+            int depth = 0;
+            if (!firstKeys.empty() && (start == firstKeys[0]))
+            {
+                /* Resumes at the given sequence, every cursor pointing past the move to the next key */
+                for (int level = 0; level < LAST; ++level)
+                {
+                    const KeyMoveRange moves = GetValidMovesForAKey(keys[level]);
+                    const KeyMove* move = std::find_if(moves.begin(), moves.end(), [&](const KeyMove& candidate)
+                    {
+                        return candidate.key == firstKeys[level + 1];
+                    });
+
+                    cursors[level] = move + 1;
+                    buffer[level + 1] = keyMoves.keyChars[move->key];
+                    if (level + 1 < LAST)
+                    {
+                        keys[level + 1] = move->key;
+                        vowels[level + 1] = vowels[level] + move->vowel;
+                    }
+                }
+
+                sink.Consume(buffer);
+                emitted++;
+                depth = LAST - 1;
+            }
+
+            while ((depth >= 0) && (emitted < limit))
+            {
+                /* Backtracks once all the valid moves of the current key are explored */
+                if (cursors[depth] == GetValidMovesForAKey(keys[depth]).end())
+                {
+                    depth--;
+                    continue;
+                }
+
+                const KeyMove& move = *cursors[depth]++;
+                unsigned int newVowels = vowels[depth] + move.vowel;
+                if (newVowels > maxVowelCount)
+                {
+                    CHESS_CHALLENGE_STAT(localStats.prunedByVowel++;)
+                    continue;
+                }
+
+                buffer[depth + 1] = keyMoves.keyChars[move.key];
+                if (depth + 1 == LAST)
+                {
+                    sink.Consume(buffer);
+                    emitted++;
+                    continue;
+                }
+
+                depth++;
+                keys[depth] = move.key;
+                vowels[depth] = newVowels;
+                cursors[depth] = GetValidMovesForAKey(move.key).begin();
+                CHESS_CHALLENGE_STAT(localStats.nodesExpanded++;)
+            }
+        }
+
+        CHESS_CHALLENGE_STAT(RecordStats(localStats);)
+    }
+
+    const KeySymmetry& GetKeySymmetry()
+    {
+        if (!keySymmetry)
+        {
+            keySymmetry = std::make_unique<KeySymmetry>();
+            keySymmetry->Build(keyMoves, keyboardLayout.GetRows(), keyboardLayout.GetCols());
+        }
+
+        return *keySymmetry;
+    }
+
+    /*
+    Returns the symmetries of keyMoves for the counting engines, or nullptr
+    when there are none or when the DP is too small for them to pay off.
+    */
+    const KeySymmetry* GetCountingSymmetry()
+    {
+        const size_t states = static_cast<size_t>(keyMoves.GetKeyCount()) * (maxVowelCount + 1);
+        if ((states < SYMMETRY_MIN_STATES) || (sequenceLength < SYMMETRY_MIN_LENGTH))
+        {
+            return nullptr;
+        }
+
+        const KeySymmetry& symmetry = GetKeySymmetry();
+        return symmetry.IsTrivial() ? nullptr : &symmetry;
+    }
+
+    const SequenceRanker<SaturatingCount>& GetRanker()
+    {
+        if (!ranker)
+        {
+            ranker = std::make_unique<SequenceRanker<SaturatingCount>>(keyMoves, sequenceLength, maxVowelCount);
+        }
+
+        return *ranker;
+    }
+
+    /* Merges the counters of one traversal, which may run on any thread. */
+    void RecordStats(const TraversalStats& localStats) const
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.Merge(localStats);
+    }
+
+    /* Generate sequences starting from each key on the keyboard */
+    KeySequences GenerateSequences() 
+    {
+        /* 
+        Defines an unordered map to store the sequences
+        generated for each key on the keyboard. 
+        */
+        KeySequences sequences;
+
+        /* Iterates through each key on the keyboard, blank cells are not part of the table */
+        for (int start : keyMoves.GetKeysInCellOrder())
+        {
+            PackedSequences keySequences;
+            GenerateSequencesFromKey(start, keySequences);
+            if (!keySequences.empty())
+            {
+                /* Appends, as several positions of a layout may hold the same key */
+                sequences[keyMoves.keyChars[start]].Append(keySequences);
+            }
+        }
+
+        return sequences;
+    }
+
+    /*
+    Generate sequences starting from each key on the keyboard using a pool
+    of threads. The BFS of every start key is independent, so each worker
+    repeatedly claims the next unprocessed start key and stores its
+    sequences in a slot of its own; the slots are merged into the map once
+    all the workers are done.
+    */
+    KeySequences GenerateSequencesInParallel()
+    {
+        const int KEYS = keyMoves.GetKeyCount();
+        const unsigned int workerCount = std::min<unsigned int>(GetThreadCount(), std::max(KEYS, 1));
+        vector<PackedSequences> keySequences(KEYS);
+        std::atomic<int> nextStart(0);
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+
+        auto worker = [&]()
+        {
+            try
+            {
+                for (int start = nextStart++; start < KEYS; start = nextStart++)
+                {
+                    GenerateSequencesFromKey(start, keySequences[start]);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                failure = std::current_exception();
+                nextStart = KEYS;
+            }
+        };
+
+        vector<std::thread> workers;
+        for (unsigned int i = 1; i < workerCount; ++i)
+        {
+            workers.emplace_back(worker);
+        }
+
+        worker();
+        for (auto& thread : workers)
+        {
+            thread.join();
+        }
+
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+
+        KeySequences sequences;
+        for (int start : keyMoves.GetKeysInCellOrder())
+        {
+            if (!keySequences[start].empty())
+            {
+                sequences[keyMoves.keyChars[start]].Append(keySequences[start]);
+            }
+        }
+
+        return sequences;
+    }
+
+    /*
+    Splits the search into prefix tasks of (at most) prefixDepth keys. The
+    prefixes are enumerated with the same BFS, in the cell order of the
+    start keys, dropping those that already exceed the vowel limit.
+    */
+    vector<PrefixTask> GeneratePrefixTasks() const
+    {
+        CheckKeysAreChars();
+
+        const unsigned int depth = std::max(1u, std::min(prefixDepth, sequenceLength));
+        vector<PrefixTask> tasks;
+        CHESS_CHALLENGE_STAT(TraversalStats localStats;)
+
+        for (int start : keyMoves.GetKeysInCellOrder())
+        {
+            if (keyMoves.vowels[start] > maxVowelCount)
+            {
+                continue;
+            }
+
+            queue<PrefixTask> q;
+            q.push({string(1, keyMoves.keyChars[start]), start, start, keyMoves.vowels[start], 0});
+
+            while (!q.empty())
+            {
+                PrefixTask task = q.front();
+                q.pop();
+
+                if (task.prefix.size() == depth)
+                {
+                    tasks.push_back(task);
+                    continue;
+                }
+
+                CHESS_CHALLENGE_STAT(localStats.nodesExpanded++;)
+                for (const auto& move : GetValidMovesForAKey(task.lastKey))
+                {
+                    if (task.vowels + move.vowel <= maxVowelCount)
+                    {
+                        q.push({task.prefix + keyMoves.keyChars[move.key], start, move.key, task.vowels + move.vowel, 0});
+                    }
+                    else
+                    {
+                        CHESS_CHALLENGE_STAT(localStats.prunedByVowel++;)
+                    }
+                }
+            }
+        }
+
+        CHESS_CHALLENGE_STAT(RecordStats(localStats);)
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            tasks[i].slot = i;
+        }
+
+        return tasks;
+    }
+
+    /*
+    Generate sequences starting from each key on the keyboard by splitting
+    the search into prefix tasks and running them on a work-stealing
+    scheduler. Start keys have very different numbers of moves, so finer
+    prefix tasks balance the load far better than one task per start key.
+    */
+    KeySequences GenerateSequencesByWorkStealing()
+    {
+        vector<PrefixTask> tasks = GeneratePrefixTasks();
+        vector<PackedSequences> taskSequences(tasks.size());
+        vector<int> taskStarts(tasks.size());
+        for (const auto& task : tasks)
+        {
+            taskStarts[task.slot] = task.startKey;
+        }
+
+        WorkStealingScheduler<PrefixTask> scheduler(GetThreadCount());
+        scheduler.Run(std::move(tasks), [&](const PrefixTask& task)
+        {
+            GenerateSequencesFromPrefix(task.prefix, task.lastKey, task.vowels, [&](const string& seq)
+            {
+                taskSequences[task.slot].Append(seq);
+            });
+        });
+
+        /* Merges the task results into the per-key map in task order */
+        KeySequences sequences;
+        for (size_t slot = 0; slot < taskSequences.size(); ++slot)
+        {
+            if (taskSequences[slot].empty())
+            {
+                continue;
+            }
+
+            sequences[keyMoves.keyChars[taskStarts[slot]]].Append(taskSequences[slot]);
+        }
+
+        return sequences;
+    }
+
+    /*
+    Counts the sequences without materializing them. Every partial sequence
+    of a given length is fully described, as far as its valid extensions are
+    concerned, by the key it ends on and the number of vowels it contains, so
+    the number of partial sequences per (key, vowels used) state is carried
+    from one level to the next through the precomputed valid moves. The
+    memory needed is O(N * maxVowelCount) regardless of the sequence length.
+    When the move graph has symmetries, the DP runs over one state per
+    orbit of keys instead, and every orbit is weighted by its size.
+    */
+    template<typename CountType>
+    CountType CountSequencesByDynamicProgramming()
+    {
+        const KeySymmetry* symmetry = GetCountingSymmetry();
+        const bool reduced = (nullptr != symmetry);
+        const KeyMoveTable& table = reduced ? symmetry->orbitMoves : keyMoves;
+        const int KEYS = table.GetKeyCount();
+        const unsigned int vowelStates = maxVowelCount + 1;
+        const size_t stride = GetCountStride<CountType>(vowelStates);
+
+        /* counts[key * stride + v]: sequences ending at key with v vowels */
+        vector<CountType> counts(KEYS * stride, CountType(0));
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+
+        /* Level 1: every valid key starts a sequence containing only itself */
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (table.vowels[key] <= maxVowelCount)
+            {
+                counts[key * stride + table.vowels[key]] = CountType(1);
+            }
+        }
+
+        for (unsigned int level = 1; level < sequenceLength; ++level)
+        {
+            CountSequencesStep(table, vowelStates, stride, counts.data(), nextCounts.data(), 0, KEYS);
+            counts.swap(nextCounts);
+        }
+
+        CountType totalSequenceCount(0);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            CountType keyCount(0);
+            for (unsigned int v = 0; v < vowelStates; ++v)
+            {
+                keyCount += counts[key * stride + v];
+            }
+
+            totalSequenceCount += reduced ? CountType(symmetry->orbitSizes[key]) * keyCount : keyCount;
+        }
+
+        return totalSequenceCount;
+    }
+
+    /*
+    Runs the (sequenceLength - 1) DP levels over a table starting from the
+    given level-1 counts, laid out with the given stride, and returns the
+    per-key totals of the last level.
+    */
+    template<typename CountType>
+    vector<CountType> CountSequencesPerKey(const KeyMoveTable& table, vector<CountType> counts, size_t stride) const
+    {
+        const unsigned int vowelStates = maxVowelCount + 1;
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+        for (unsigned int level = 1; level < sequenceLength; ++level)
+        {
+            CountSequencesStep(table, vowelStates, stride, counts.data(), nextCounts.data(), 0, table.GetKeyCount());
+            counts.swap(nextCounts);
+        }
+
+        vector<CountType> totals(table.GetKeyCount(), CountType(0));
+        for (int key = 0; key < table.GetKeyCount(); ++key)
+        {
+            for (unsigned int v = 0; v < vowelStates; ++v)
+            {
+                totals[key] += counts[key * stride + v];
+            }
+        }
+
+        return totals;
+    }
+
+    /*
+    Sparse engine for large layouts. It runs the same recurrence as the
+    dynamic programming, as one sparse matrix-vector product per level over
+    the CSR incoming moves, but on the keys ordered tile by tile for cache
+    locality, and splits the destination keys of every level into ranges
+    of about the same number of moves, one per thread.
+    */
+    template<typename CountType>
+    CountType CountSequencesBySparseMatrix()
+    {
+        /* Over the orbits of the keys when the move graph has symmetries, as in the DP */
+        const KeySymmetry* symmetry = GetCountingSymmetry();
+        const int COLS = keyboardLayout.GetCols();
+        if (tiledKeyMoves.offsets.empty())
+        {
+            tiledKeyMoves = (symmetry ? symmetry->orbitMoves : keyMoves).GetTiled(keyboardLayout.GetRows(), COLS, SPARSE_TILE_SIZE);
+        }
+
+        const KeyMoveTable& table = tiledKeyMoves;
+        const int KEYS = table.GetKeyCount();
+        const unsigned int vowelStates = maxVowelCount + 1;
+        const size_t stride = GetCountStride<CountType>(vowelStates);
+        const unsigned int workerCount = std::max(1, std::min<int>(GetThreadCount(), KEYS));
+
+        /* Splits the keys so that every worker gets about the same number of incoming moves, the tiled rows being packed */
+        vector<int> firstKeys(workerCount + 1, KEYS);
+        for (unsigned int worker = 0; worker < workerCount; ++worker)
+        {
+            const int moveCount = table.incomingMoves.size() * static_cast<int64_t>(worker) / workerCount;
+            firstKeys[worker] = std::lower_bound(table.incomingOffsets.begin(), table.incomingOffsets.end(), moveCount) - table.incomingOffsets.begin();
+        }
+
+        vector<CountType> counts(KEYS * stride, CountType(0));
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (table.vowels[key] <= maxVowelCount)
+            {
+                counts[key * stride + table.vowels[key]] = CountType(1);
+            }
+        }
+
+        /*
+        The workers live for the whole run and cross the barrier after every
+        level, each swapping its own view of the two count buffers. A failed
+        worker keeps crossing the barrier so that the others never block.
+        */
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+        std::atomic<bool> failed(false);
+        LevelBarrier barrier(workerCount);
+        auto work = [&](unsigned int worker)
+        {
+            CountType* current = counts.data();
+            CountType* next = nextCounts.data();
+            for (unsigned int level = 1; level < sequenceLength; ++level)
+            {
+                try
+                {
+                    if (!failed)
+                    {
+                        CountSequencesStep(table, vowelStates, stride, current, next, firstKeys[worker], firstKeys[worker + 1]);
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    failure = std::current_exception();
+                    failed = true;
+                }
+
+                barrier.ArriveAndWait();
+                std::swap(current, next);
+            }
+        };
+
+        vector<std::thread> workers;
+        for (unsigned int worker = 1; worker < workerCount; ++worker)
+        {
+            workers.emplace_back(work, worker);
+        }
+
+        work(0);
+        for (auto& thread : workers)
+        {
+            thread.join();
+        }
+
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+
+        /* The last level wrote nextCounts when it ran an odd number of levels */
+        const vector<CountType>& finalCounts = (0 == (sequenceLength - 1) % 2) ? counts : nextCounts;
+        CountType totalSequenceCount(0);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            CountType keyCount(0);
+            for (unsigned int v = 0; v < vowelStates; ++v)
+            {
+                keyCount += finalCounts[key * stride + v];
+            }
+
+            if (symmetry)
+            {
+                const auto& [x, y] = table.positions[key];
+                keyCount = CountType(symmetry->orbitSizes[symmetry->orbitMoves.cellKeys[x * COLS + y]]) * keyCount;
+            }
+            totalSequenceCount += keyCount;
+        }
+
+        return totalSequenceCount;
+    }
+
+    /*
+    Runs the same (key, vowels used) recurrence as the dynamic-programming
+    mode over bitboards of the layout. The frontier, i.e. the set of cells
+    that can end a partial sequence, is expanded with shifts and masks, and
+    the counts are pushed along the set bits of the precomputed attack
+    bitboards, for all the start keys at once.
+    */
+    template<typename CountType>
+    CountType CountSequencesByBitboard()
+    {
+        if (!keyboardLayout.FitsInBitboard())
+        {
+            throw invalid_argument("Bitboard counting requires a layout of at most 64 cells.");
+        }
+
+        /* Rebuilt here after layout edits */
+        if (attackBitboards.empty())
+        {
+            SetBitboardsForAllKeys();
+        }
+
+        const int CELLS = keyboardLayout.GetRows() * keyboardLayout.GetCols();
+        const unsigned int vowelStates = maxVowelCount + 1;
+
+        /* counts[cell * vowelStates + v]: sequences ending at cell with v vowels */
+        vector<CountType> counts(CELLS * vowelStates, CountType(0));
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+
+        /* Level 1: every valid key starts a sequence containing only itself */
+        Bitboard frontier = keyboardLayout.GetOccupancyMask();
+        if (0 == maxVowelCount)
+        {
+            frontier &= ~vowelBitboard;
+        }
+
+        for (Bitboard cells = frontier; cells;)
+        {
+            int cell = PopLowestCell(cells);
+            counts[cell * vowelStates + ((vowelBitboard >> cell) & 1)] = CountType(1);
+        }
+
+        for (unsigned int level = 1; level < sequenceLength; ++level)
+        {
+            Bitboard nextFrontier = ExpandFrontier(frontier);
+            if (0 == maxVowelCount)
+            {
+                nextFrontier &= ~vowelBitboard;
+            }
+
+            for (Bitboard cells = nextFrontier; cells;)
+            {
+                int cell = PopLowestCell(cells);
+                std::fill(&nextCounts[cell * vowelStates], &nextCounts[cell * vowelStates] + vowelStates, CountType(0));
+            }
+
+            for (Bitboard sources = frontier; sources;)
+            {
+                int source = PopLowestCell(sources);
+                const CountType* current = &counts[source * vowelStates];
+
+                for (Bitboard targets = attackBitboards[source] & nextFrontier; targets;)
+                {
+                    int target = PopLowestCell(targets);
+                    unsigned int addedVowels = (vowelBitboard >> target) & 1;
+                    CountType* next = &nextCounts[target * vowelStates];
+
+                    /* Drops the states that would exceed the vowel limit */
+                    for (unsigned int v = 0; v + addedVowels <= maxVowelCount; ++v)
+                    {
+                        next[v + addedVowels] += current[v];
+                    }
+                }
+            }
+
+            counts.swap(nextCounts);
+            frontier = nextFrontier;
+        }
+
+        CountType totalSequenceCount(0);
+        for (Bitboard cells = frontier; cells;)
+        {
+            int cell = PopLowestCell(cells);
+            for (unsigned int v = 0; v < vowelStates; ++v)
+            {
+                totalSequenceCount += counts[cell * vowelStates + v];
+            }
+        }
+
+        return totalSequenceCount;
+    }
+
+    /* Multiplies two square matrices of the same size. */
+    template<typename CountType>
+    static CountMatrix<CountType> MultiplyMatrices(const CountMatrix<CountType>& lhs, const CountMatrix<CountType>& rhs)
+    {
+        const size_t SIZE = lhs.size();
+        CountMatrix<CountType> product(SIZE, vector<CountType>(SIZE, CountType(0)));
+
+        for (size_t i = 0; i < SIZE; ++i)
+        {
+            for (size_t k = 0; k < SIZE; ++k)
+            {
+                if (lhs[i][k] == CountType(0))
+                {
+                    continue;
+                }
+
+                for (size_t j = 0; j < SIZE; ++j)
+                {
+                    product[i][j] += lhs[i][k] * rhs[k][j];
+                }
+            }
+        }
+
+        return product;
+    }
+
+    /* Multiplies a row vector by a square matrix. */
+    template<typename CountType>
+    static vector<CountType> MultiplyVectorByMatrix(const vector<CountType>& row, const CountMatrix<CountType>& matrix)
+    {
+        const size_t SIZE = matrix.size();
+        vector<CountType> product(SIZE, CountType(0));
+
+        for (size_t k = 0; k < SIZE; ++k)
+        {
+            if (row[k] == CountType(0))
+            {
+                continue;
+            }
+
+            for (size_t j = 0; j < SIZE; ++j)
+            {
+                product[j] += row[k] * matrix[k][j];
+            }
+        }
+
+        return product;
+    }
+
+    /*
+    Counts the sequences with the same (key, vowels used) recurrence as the
+    dynamic-programming mode, but expressed as a transition matrix built from
+    the precomputed valid moves. The level-1 state vector is multiplied by the
+    matrix raised to the power (sequenceLength - 1) using repeated squaring,
+    which costs O(S^3 * log(sequenceLength)) for S states instead of one pass
+    per level.
+    */
+    template<typename CountType>
+    CountType CountSequencesByMatrixPower()
+    {
+        const int KEYS = keyMoves.GetKeyCount();
+        const unsigned int vowelStates = maxVowelCount + 1;
+        const size_t STATES = KEYS * vowelStates;
+
+        CountMatrix<CountType> transitions(STATES, vector<CountType>(STATES, CountType(0)));
+        vector<CountType> counts(STATES, CountType(0));
+
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (keyMoves.vowels[key] <= maxVowelCount)
+            {
+                counts[key * vowelStates + keyMoves.vowels[key]] = CountType(1);
+            }
+
+            for (const auto& move : GetValidMovesForAKey(key))
+            {
+                for (unsigned int v = 0; v + move.vowel <= maxVowelCount; ++v)
+                {
+                    transitions[key * vowelStates + v][move.key * vowelStates + v + move.vowel] += CountType(1);
+                }
+            }
+        }
+
+        /* Applies the transitions (sequenceLength - 1) times by repeated squaring */
+        for (unsigned int power = sequenceLength - 1; power > 0; power >>= 1)
+        {
+            if (power & 1)
+            {
+                counts = MultiplyVectorByMatrix(counts, transitions);
+            }
+
+            if (power > 1)
+            {
+                transitions = MultiplyMatrices(transitions, transitions);
+            }
+        }
+
+        CountType totalSequenceCount(0);
+        for (const CountType& count : counts)
+        {
+            totalSequenceCount += count;
+        }
+
+        return totalSequenceCount;
+    }
+
+public:
+    /* 
+    DI: The dependencies: keyboard layout and the chess-piece
+    are injected through the constructor. So is the predicate
+    deciding which keys count against the vowel limit.
+    */
+    Keyboard(const unsigned int &_sequenceLength, const unsigned int &_maxVowelCount, const KeyboardLayout& _keyboardLayout, const ChessPiece* _chessPiecePtr,
+             const KeyPredicate& _isVowelPredicate = IsVowelKey)
+        : sequenceLength(_sequenceLength), maxVowelCount(_maxVowelCount), keyboardLayout(_keyboardLayout), chessPiecePtr(_chessPiecePtr),
+          isVowelPredicate(_isVowelPredicate) 
+    {
+        Initialize([this]()
+        {
+            SetValidMovesForAllKeys(chessPiecePtr);
+        });
+    }
+
+    /* 
+    Chess-pieces known at compile time take the static path, where
+    the move set is inlined into the precomputation.
+    */
+    template<typename Piece>
+    Keyboard(const unsigned int &_sequenceLength, const unsigned int &_maxVowelCount, const KeyboardLayout& _keyboardLayout, const StaticChessPiece<Piece>* _chessPiecePtr,
+             const KeyPredicate& _isVowelPredicate = IsVowelKey)
+        : sequenceLength(_sequenceLength), maxVowelCount(_maxVowelCount), keyboardLayout(_keyboardLayout), chessPiecePtr(_chessPiecePtr),
+          isVowelPredicate(_isVowelPredicate) 
+    {
+        Initialize([this, _chessPiecePtr]()
+        {
+            SetValidMovesForAllKeys(_chessPiecePtr);
+        });
+    }
+
+    /*
+    Catches up with the edits made to the layout since the move table was
+    built; the queries call it on their own, so it only needs calling
+    before the const ones. Only the moves of the edited cells and of the
+    cells depending on them through the chess-piece are recomputed, e.g.
+    the knight moves around a blanked key, and only the caches derived
+    from the move table are dropped, to be rebuilt on their next use.
+    */
+    void ApplyLayoutEdits()
+    {
+        const uint64_t version = keyboardLayout.GetVersion();
+        if (layoutVersion == version)
+        {
+            return;
+        }
+
+        CHESS_CHALLENGE_STAT(const auto start = std::chrono::steady_clock::now();)
+        const KeyCode INVALID_KEY = keyboardLayout.GetInvalidKey();
+        const vector<LayoutEdit>& edits = keyboardLayout.GetEdits();
+        vector<Coordinates> dirtyCells;
+        for (auto edit = edits.begin() + layoutVersion; edit != edits.end(); ++edit)
+        {
+            dirtyCells.push_back({edit->x, edit->y});
+
+            /* Renaming a key leaves the moves as they are, only its vowel flag is patched */
+            if ((INVALID_KEY == edit->oldKey) != (INVALID_KEY == edit->newKey))
+            {
+                const vector<Coordinates> dependentCells = chessPiecePtr->GetDependentCells(edit->x, edit->y, keyboardLayout);
+                dirtyCells.insert(dirtyCells.end(), dependentCells.begin(), dependentCells.end());
+            }
+        }
+
+        keyMoves.Update(keyboardLayout, std::move(dirtyCells), chessPiecePtr, isVowelPredicate);
+        layoutVersion = version;
+
+        ranker.reset();
+        keySymmetry.reset();
+        tiledKeyMoves = KeyMoveTable();
+        attackBitboards.clear();
+        CHESS_CHALLENGE_STAT(stats.precomputeNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();)
+    }
+
+    /* Sets the number of threads of the parallel modes, 0 selects the hardware concurrency. */
+    void SetThreadCount(unsigned int newThreadCount)
+    {
+        threadCount = newThreadCount;
+    }
+
+    /* Sets the number of keys in the prefix of every work-stealing task. */
+    void SetPrefixDepth(unsigned int newPrefixDepth)
+    {
+        prefixDepth = newPrefixDepth;
+    }
+
+    unsigned int GetThreadCount() const
+    {
+        if (threadCount > 0)
+        {
+            return threadCount;
+        }
+
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    unsigned int GetSequenceLength() const
+    {
+        return sequenceLength;
+    }
+
+    unsigned int GetMaxVowelCount() const
+    {
+        return maxVowelCount;
+    }
+
+    const KeyboardLayout& GetKeyboardLayout() const
+    {
+        return keyboardLayout;
+    }
+
+    const ChessPiece* GetChessPiece() const
+    {
+        return chessPiecePtr;
+    }
+
+    /*
+    Returns a ranker over the sequences of this keyboard, see
+    SequenceRanker; it refers to the move table of the keyboard.
+    */
+    template<typename CountType = uint64_t>
+    SequenceRanker<CountType> GetSequenceRanker() const
+    {
+        CheckLayoutIsCurrent();
+        return SequenceRanker<CountType>(keyMoves, sequenceLength, maxVowelCount);
+    }
+
+    /*
+    Returns the k-th valid sequence in depth-first enumeration order
+    without enumerating the sequences before it.
+    */
+    string Unrank(uint64_t rank)
+    {
+        ApplyLayoutEdits();
+        return GetRanker().Unrank(SaturatingCount(rank));
+    }
+
+    /*
+    Returns the index of a valid sequence in depth-first enumeration order,
+    throwing out_of_range when it does not fit below UINT64_MAX.
+    */
+    uint64_t Rank(std::string_view sequence)
+    {
+        ApplyLayoutEdits();
+        const uint64_t rank = GetRanker().Rank(sequence).GetValue();
+        if (UINT64_MAX == rank)
+        {
+            throw std::out_of_range("Sequence rank does not fit 64 bits.");
+        }
+
+        return rank;
+    }
+
+    /* Returns the distinct keys of the layout as chars, in row-major cell order. */
+    string GetKeyAlphabet() const
+    {
+        CheckLayoutIsCurrent();
+        CheckKeysAreChars();
+
+        string alphabet;
+        for (int index : keyMoves.GetKeysInCellOrder())
+        {
+            const char key = keyMoves.keyChars[index];
+            if (string::npos == alphabet.find(key))
+            {
+                alphabet += key;
+            }
+        }
+
+        return alphabet;
+    }
+
+    /* Returns the counters of the last run, all zero unless compiled with -DCHESS_CHALLENGE_STATS. */
+    TraversalStats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        return stats;
+    }
+
+    /*
+    Breaks the number of sequences down per start key and per end key,
+    straight from the DP. The per-end counts come from the forward DP and
+    the per-start counts from the same DP run over the reversed move graph.
+    The start x end matrix, when requested, runs one forward DP per start
+    key, which takes O(N^2) memory for the result.
+    */
+    template<typename CountType = uint64_t>
+    SequenceBreakdown<CountType> GetSequenceBreakdown(bool includeStartEndMatrix = false) const
+    {
+        CheckLayoutIsCurrent();
+        const int KEYS = keyMoves.GetKeyCount();
+        const size_t stride = GetCountStride<CountType>(maxVowelCount + 1);
+        SequenceBreakdown<CountType> breakdown;
+        breakdown.keys = keyMoves.keys;
+
+        vector<CountType> initialCounts(KEYS * stride, CountType(0));
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (keyMoves.vowels[key] <= maxVowelCount)
+            {
+                initialCounts[key * stride + keyMoves.vowels[key]] = CountType(1);
+            }
+        }
+
+        if (!includeStartEndMatrix)
+        {
+            breakdown.perEndKey = CountSequencesPerKey(keyMoves, initialCounts, stride);
+            breakdown.perStartKey = CountSequencesPerKey(keyMoves.GetReversed(), initialCounts, stride);
+            return breakdown;
+        }
+
+        breakdown.perStartKey.assign(KEYS, CountType(0));
+        breakdown.perEndKey.assign(KEYS, CountType(0));
+        breakdown.startEnd.assign(KEYS * KEYS, CountType(0));
+        for (int start = 0; start < KEYS; ++start)
+        {
+            if (keyMoves.vowels[start] > maxVowelCount)
+            {
+                continue;
+            }
+
+            vector<CountType> startCounts(KEYS * stride, CountType(0));
+            startCounts[start * stride + keyMoves.vowels[start]] = CountType(1);
+            vector<CountType> endCounts = CountSequencesPerKey(keyMoves, std::move(startCounts), stride);
+
+            for (int end = 0; end < KEYS; ++end)
+            {
+                breakdown.startEnd[start * KEYS + end] = endCounts[end];
+                breakdown.perStartKey[start] += endCounts[end];
+                breakdown.perEndKey[end] += endCounts[end];
+            }
+        }
+
+        return breakdown;
+    }
+
+    /*
+    Streams every valid sequence to the sink as it is produced, start key
+    by start key, instead of collecting them all in memory first.
+    */
+    void EnumerateSequences(SequenceSink& sink)
+    {
+        ApplyLayoutEdits();
+        CHESS_CHALLENGE_STAT(StatsRun statsRun(*this);)
+        CheckKeysAreChars();
+
+        for (int start : keyMoves.GetKeysInCellOrder())
+        {
+            GenerateSequencesFromPrefix(string(1, keyMoves.keyChars[start]), start, keyMoves.vowels[start], [&](const string& seq)
+            {
+                sink.Consume(seq);
+            });
+        }
+    }
+
+    /*
+    Streams every valid sequence to the sink, searching from one start key
+    per orbit of the symmetries of the move graph only: every sequence found
+    is also streamed mapped onto each other key of its orbit. The order
+    differs from EnumerateSequences(). Layouts with duplicate keys, whose
+    symmetries cannot be applied to the keys as chars, are enumerated in full.
+    */
+    void EnumerateSequencesBySymmetry(SequenceSink& sink)
+    {
+        ApplyLayoutEdits();
+        CHESS_CHALLENGE_STAT(StatsRun statsRun(*this);)
+        CheckKeysAreChars();
+
+        const KeySymmetry& symmetry = GetKeySymmetry();
+        if (GetKeyAlphabet().size() != keyMoves.keyChars.size())
+        {
+            EnumerateSequences(sink);
+            return;
+        }
+
+        for (size_t orbit = 0; orbit < symmetry.representatives.size(); ++orbit)
+        {
+            /* One char map per other key of the orbit */
+            const int start = symmetry.representatives[orbit];
+            vector<std::array<char, 256>> charMaps;
+            vector<int> images(1, start);
+            for (const auto& permutation : symmetry.automorphisms)
+            {
+                if (std::find(images.begin(), images.end(), permutation[start]) != images.end())
+                {
+                    continue;
+                }
+
+                images.push_back(permutation[start]);
+                charMaps.emplace_back();
+                for (int key = 0; key < keyMoves.GetKeyCount(); ++key)
+                {
+                    charMaps.back()[static_cast<unsigned char>(keyMoves.keyChars[key])] = keyMoves.keyChars[permutation[key]];
+                }
+            }
+
+            string image(sequenceLength, '\0');
+            GenerateSequencesFromPrefix(string(1, keyMoves.keyChars[start]), start, keyMoves.vowels[start], [&](const string& seq)
+            {
+                sink.Consume(seq);
+                for (const auto& charMap : charMaps)
+                {
+                    for (size_t i = 0; i < seq.size(); ++i)
+                    {
+                        image[i] = charMap[static_cast<unsigned char>(seq[i])];
+                    }
+                    sink.Consume(image);
+                }
+            });
+        }
+    }
+
+    /*
+    Streams every valid sequence to the sink using an iterative depth-first
+    search instead of the BFS. It keeps a single buffer of sequenceLength
+    keys and, for every depth, the current key, its vowel count and a cursor
+    into its valid moves, so the memory is O(sequenceLength) and no
+    recursion is involved.
+    */
+    void EnumerateSequencesDepthFirst(SequenceSink& sink)
+    {
+        ApplyLayoutEdits();
+        CHESS_CHALLENGE_STAT(StatsRun statsRun(*this);)
+        CheckKeysAreChars();
+
+        EnumerateDepthFirst({}, UINT64_MAX, sink);
+    }
+
+    /*
+    Returns the [first, last) rank range of one of shardCount contiguous
+    shards of about the same size covering all the sequences, throwing
+    out_of_range when there are too many sequences for 64-bit ranks.
+    */
+    pair<uint64_t, uint64_t> GetShardRange(unsigned int shard, unsigned int shardCount)
+    {
+        ApplyLayoutEdits();
+        if (shard >= shardCount)
+        {
+            throw invalid_argument("Shard must be one of the shard count.");
+        }
+
+        /* The count saturates at UINT64_MAX, so that many sequences or more cannot all be ranked */
+        const Count128 total = GetRanker().GetCount().GetValue();
+        if (UINT64_MAX == total)
+        {
+            throw std::out_of_range("Too many sequences to shard by 64-bit ranks.");
+        }
+
+        return {static_cast<uint64_t>(total * shard / shardCount), static_cast<uint64_t>(total * (shard + 1) / shardCount)};
+    }
+
+    /*
+    Streams the sequences whose rank is in [first, last), in depth-first
+    order. The first one is found by unranking, and the depth-first search
+    resumes from there, so a shard costs no more than its own sequences.
+    Shards streamed in order produce the same output as
+    EnumerateSequencesDepthFirst().
+    */
+    void EnumerateSequenceRange(uint64_t first, uint64_t last, SequenceSink& sink)
+    {
+        ApplyLayoutEdits();
+        CHESS_CHALLENGE_STAT(StatsRun statsRun(*this);)
+        last = std::min(last, GetRanker().GetCount().GetValue());
+        if (first < last)
+        {
+            EnumerateDepthFirst(GetRanker().UnrankKeys(SaturatingCount(first)), last - first, sink);
+        }
+    }
+
+    /*
+    Counts the unique sequences possible with the provided constraints
+    using the requested mode. The count type decides the range of the
+    result, e.g. uint64_t, Count128, ModularCount<> or BigCount.
+    */
+    template<typename CountType = uint64_t>
+    CountType CountSequences(CountingMode mode = CountingMode::DynamicProgramming)
+    {
+        ApplyLayoutEdits();
+        CHESS_CHALLENGE_STAT(StatsRun statsRun(*this);)
+        if ((CountingMode::SparseMatrix == mode) ||
+            ((CountingMode::DynamicProgramming == mode) && (keyMoves.GetKeyCount() * (maxVowelCount + 1) >= SPARSE_STATE_THRESHOLD)))
+        {
+            return CountSequencesBySparseMatrix<CountType>();
+        }
+
+        if (CountingMode::DynamicProgramming == mode)
+        {
+            return CountSequencesByDynamicProgramming<CountType>();
+        }
+
+        if (CountingMode::MatrixPower == mode)
+        {
+            return CountSequencesByMatrixPower<CountType>();
+        }
+
+        /* The device kernel counts in uint64_t, so the other count types stay on the CPU DP */
+        if (CountingMode::Offload == mode)
+        {
+            if constexpr (std::is_same_v<CountType, uint64_t>)
+            {
+                BatchedSequenceCounter counter;
+                counter.Add(keyMoves);
+                return counter.CountSequences(sequenceLength, maxVowelCount)[0];
+            }
+            else
+            {
+                return CountSequencesByDynamicProgramming<CountType>();
+            }
+        }
+
+        if (CountingMode::Bitboard == mode)
+        {
+            return CountSequencesByBitboard<CountType>();
+        }
+
+        if (CountingMode::Enumerate == mode)
+        {
+            CountingSequenceSink counter;
+            EnumerateSequences(counter);
+            return CountType(counter.GetCount());
+        }
+
+        if (CountingMode::DepthFirst == mode)
+        {
+            CountingSequenceSink counter;
+            EnumerateSequencesDepthFirst(counter);
+            return CountType(counter.GetCount());
+        }
+
+        CountType totalSequenceCount(0);
+        auto sequences = (CountingMode::ParallelEnumerate == mode) ? GenerateSequencesInParallel() : GenerateSequencesByWorkStealing();
+
+        for (const auto& seq : sequences) 
+        {
+            totalSequenceCount += CountType(static_cast<uint64_t>(seq.second.size()));
+        }
+
+        return totalSequenceCount;
+    }
+
+    /*
+    Displays the total number of unique sequences 
+    possible with the provided constraints.
+    */ 
+    template<typename CountType = uint64_t>
+    void displayTotalSequences(CountingMode mode = CountingMode::DynamicProgramming) 
+    {
+        try
+        {
+            cout << "Total number of sequences: " << ToString(CountSequences<CountType>(mode)) << endl;
+        }
+        catch (const exception& e) 
+        {
+            cerr << "Exception during sequence generation: " << e.what() << endl;
+            throw;
+        }
+        
+    }
+};
+
+/* A (sequence length, vowel limit) query answered by the SequenceQueryEngine. */
+struct SequenceQuery
+{
+    unsigned int sequenceLength;
+    unsigned int maxVowelCount;
+};
+
+/* A key required at a position (from 0) of the sequence. */
+struct PinnedKey
+{
+    unsigned int position;
+    KeyCode key;
+};
+
+/*
+A point query answered by the SequenceQueryEngine: the number of
+sequences of a length and vowel limit with the given keys at the given
+positions, e.g. a start key at position 0 and an end key at the last one.
+*/
+struct PinnedSequenceQuery
+{
+    unsigned int sequenceLength;
+    unsigned int maxVowelCount;
+    vector<PinnedKey> pinnedKeys;
+};
+
+/*
+The SequenceQueryEngine answers many queries against one keyboard layout
+and chess-piece, which are injected through the constructor as for the
+Keyboard class. The move table is built once and every batch of queries
+is answered by a single dynamic-programming sweep up to the longest
+requested length, tracking the exact vowel count up to the largest
+requested limit: the answer to a query is then the number of states of
+its length with no more vowels than its limit.
+*/
+class SequenceQueryEngine
+{
+private:
+    KeyMoveTable keyMoves;
+    /* The reversed move graph, for the backward half of the pinned queries */
+    KeyMoveTable reversedMoves;
+
+    /*
+    Runs the DP over the positions from first to last (included), in either
+    direction, over the given table, dropping the states of the keys not
+    allowed at each position. The counts of the last position are returned.
+    */
+    template<typename CountType>
+    vector<CountType> CountPinnedHalf(const KeyMoveTable& table, const vector<vector<char>>& allowedKeys, int first, int last,
+                                      unsigned int maxVowelCount, size_t stride) const
+    {
+        const int KEYS = table.GetKeyCount();
+        const unsigned int vowelStates = maxVowelCount + 1;
+        const int direction = (first <= last) ? 1 : -1;
+        vector<CountType> counts(KEYS * stride, CountType(0));
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+
+        auto dropDisallowed = [&](int position)
+        {
+            if (allowedKeys[position].empty())
+            {
+                return;
+            }
+
+            for (int key = 0; key < KEYS; ++key)
+            {
+                if (!allowedKeys[position][key])
+                {
+                    std::fill(counts.begin() + key * stride, counts.begin() + (key + 1) * stride, CountType(0));
+                }
+            }
+        };
+
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (table.vowels[key] <= maxVowelCount)
+            {
+                counts[key * stride + table.vowels[key]] = CountType(1);
+            }
+        }
+        dropDisallowed(first);
+
+        for (int position = first; position != last; position += direction)
+        {
+            CountSequencesStep(table, vowelStates, stride, counts.data(), nextCounts.data(), 0, KEYS);
+            counts.swap(nextCounts);
+            dropDisallowed(position + direction);
+        }
+
+        return counts;
+    }
+public:
+    SequenceQueryEngine(const KeyboardLayout& keyboardLayout, const ChessPiece* chessPiecePtr, const KeyPredicate& isVowelPredicate = IsVowelKey)
+    {
+        keyMoves.Build(keyboardLayout, chessPiecePtr, isVowelPredicate);
+        reversedMoves = keyMoves.GetReversed();
+    }
+
+    template<typename Piece>
+    SequenceQueryEngine(const KeyboardLayout& keyboardLayout, const StaticChessPiece<Piece>* chessPiecePtr, const KeyPredicate& isVowelPredicate = IsVowelKey)
+    {
+        keyMoves.Build(keyboardLayout, chessPiecePtr, isVowelPredicate);
+        reversedMoves = keyMoves.GetReversed();
+    }
+
+    const KeyMoveTable& GetMoveTable() const
+    {
+        return keyMoves;
+    }
+
+    /* Answers all the queries, in order, with one dynamic-programming sweep. */
+    template<typename CountType = uint64_t>
+    vector<CountType> CountSequences(const vector<SequenceQuery>& queries) const
+    {
+        vector<CountType> results(queries.size(), CountType(0));
+        if (queries.empty())
+        {
+            return results;
+        }
+
+        unsigned int maxLength = 0;
+        unsigned int maxVowelCount = 0;
+        for (const auto& query : queries)
+        {
+            if (0 == query.sequenceLength)
+            {
+                throw invalid_argument("Sequence length must be non-zero.");
+            }
+
+            maxLength = std::max(maxLength, query.sequenceLength);
+            maxVowelCount = std::max(maxVowelCount, query.maxVowelCount);
+        }
+
+        /* Answers the queries in order of length as the sweep reaches them */
+        vector<size_t> order(queries.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            order[i] = i;
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs)
+        {
+            return queries[lhs].sequenceLength < queries[rhs].sequenceLength;
+        });
+
+        const int KEYS = keyMoves.GetKeyCount();
+        const unsigned int vowelStates = maxVowelCount + 1;
+        const size_t stride = GetCountStride<CountType>(vowelStates);
+        vector<CountType> counts(KEYS * stride, CountType(0));
+        vector<CountType> nextCounts(counts.size(), CountType(0));
+
+        for (int key = 0; key < KEYS; ++key)
+        {
+            if (keyMoves.vowels[key] <= maxVowelCount)
+            {
+                counts[key * stride + keyMoves.vowels[key]] = CountType(1);
+            }
+        }
+
+        size_t answered = 0;
+        for (unsigned int level = 1; level <= maxLength; ++level)
+        {
+            if (level > 1)
+            {
+                CountSequencesStep(keyMoves, vowelStates, stride, counts.data(), nextCounts.data(), 0, keyMoves.GetKeyCount());
+                counts.swap(nextCounts);
+            }
+
+            for (; (answered < order.size()) && (queries[order[answered]].sequenceLength == level); ++answered)
+            {
+                CountType& result = results[order[answered]];
+                for (int key = 0; key < KEYS; ++key)
+                {
+                    for (unsigned int v = 0; v <= queries[order[answered]].maxVowelCount; ++v)
+                    {
+                        result += counts[key * stride + v];
+                    }
+                }
+            }
+        }
+
+        return results;
+    }
+
+    /*
+    Answers a pinned query by meeting in the middle: a forward DP over the
+    positions up to the middle one and a backward DP over the reversed move
+    graph from the last position down to it, each over about half the
+    length, are joined on the middle key and the vowel budget. The middle
+    key is counted by both halves, so its vowel is taken off once.
+    */
+    template<typename CountType = uint64_t>
+    CountType CountSequences(const PinnedSequenceQuery& query) const
+    {
+        if (0 == query.sequenceLength)
+        {
+            throw invalid_argument("Sequence length must be non-zero.");
+        }
+
+        const int KEYS = keyMoves.GetKeyCount();
+        const int LAST = query.sequenceLength - 1;
+        vector<vector<char>> allowedKeys(query.sequenceLength);
+        for (const auto& pin : query.pinnedKeys)
+        {
+            if (pin.position >= query.sequenceLength)
+            {
+                throw invalid_argument("Pinned key position is beyond the sequence length.");
+            }
+
+            /* Several pins at the same position must all hold */
+            vector<char> allowed(KEYS, 0);
+            bool found = false;
+            for (int key = 0; key < KEYS; ++key)
+            {
+                allowed[key] = (keyMoves.keys[key] == pin.key) ? 1 : 0;
+                found = found || allowed[key];
+            }
+
+            if (!found)
+            {
+                throw invalid_argument("Pinned key is not part of the layout.");
+            }
+
+            vector<char>& current = allowedKeys[pin.position];
+            if (current.empty())
+            {
+                current = std::move(allowed);
+            }
+            else
+            {
+                for (int key = 0; key < KEYS; ++key)
+                {
+                    current[key] = current[key] && allowed[key];
+                }
+            }
+        }
+
+        const int MIDDLE = LAST / 2;
+        const size_t stride = GetCountStride<CountType>(query.maxVowelCount + 1);
+        const vector<CountType> forward = CountPinnedHalf<CountType>(keyMoves, allowedKeys, 0, MIDDLE, query.maxVowelCount, stride);
+        const vector<CountType> backward = CountPinnedHalf<CountType>(reversedMoves, allowedKeys, LAST, MIDDLE, query.maxVowelCount, stride);
+
+        CountType result(0);
+        for (int key = 0; key < KEYS; ++key)
+        {
+            const unsigned int middleVowel = keyMoves.vowels[key];
+            for (unsigned int forwardVowels = middleVowel; forwardVowels <= query.maxVowelCount; ++forwardVowels)
+            {
+                CountType backwardCount(0);
+                for (unsigned int backwardVowels = middleVowel; forwardVowels + backwardVowels - middleVowel <= query.maxVowelCount; ++backwardVowels)
+                {
+                    backwardCount += backward[key * stride + backwardVowels];
+                }
+
+                result += forward[key * stride + forwardVowels] * backwardCount;
+            }
+        }
+
+        return result;
+    }
+
+    /*
+    Returns the number of sequences starting at each key, from one backward
+    DP over the reversed move graph.
+    */
+    template<typename CountType = uint64_t>
+    vector<CountType> CountSequencesByStartKey(const SequenceQuery& query) const
+    {
+        if (0 == query.sequenceLength)
+        {
+            throw invalid_argument("Sequence length must be non-zero.");
+        }
+
+        const int KEYS = keyMoves.GetKeyCount();
+        const size_t stride = GetCountStride<CountType>(query.maxVowelCount + 1);
+        const vector<vector<char>> ALL_KEYS(query.sequenceLength);
+        const vector<CountType> counts = CountPinnedHalf<CountType>(reversedMoves, ALL_KEYS, query.sequenceLength - 1, 0, query.maxVowelCount, stride);
+
+        vector<CountType> results(KEYS, CountType(0));
+        for (int key = 0; key < KEYS; ++key)
+        {
+            for (unsigned int v = 0; v <= query.maxVowelCount; ++v)
+            {
+                results[key] += counts[key * stride + v];
+            }
+        }
+
+        return results;
+    }
+
+    /* Counts the sequences going from one key to another. */
+    template<typename CountType = uint64_t>
+    CountType CountSequencesBetween(KeyCode startKey, KeyCode endKey, unsigned int sequenceLength, unsigned int maxVowelCount) const
+    {
+        if (0 == sequenceLength)
+        {
+            throw invalid_argument("Sequence length must be non-zero.");
+        }
+
+        return CountSequences<CountType>(PinnedSequenceQuery{sequenceLength, maxVowelCount, {{0, startKey}, {sequenceLength - 1, endKey}}});
+    }
+};
+
+/* Identifies a cached result: layout, chess-piece and parameters. */
+struct SequenceCacheKey
+{
+    uint64_t layoutHash;
+    string pieceName;
+    unsigned int sequenceLength;
+    unsigned int maxVowelCount;
+
+    bool operator==(const SequenceCacheKey& other) const
+    {
+        return (layoutHash == other.layoutHash) && (pieceName == other.pieceName) &&
+               (sequenceLength == other.sequenceLength) && (maxVowelCount == other.maxVowelCount);
+    }
+};
+
+struct SequenceCacheKeyHash
+{
+    size_t operator()(const SequenceCacheKey& key) const
+    {
+        size_t hash = std::hash<uint64_t>()(key.layoutHash) ^ (std::hash<string>()(key.pieceName) << 1);
+        return hash ^ (std::hash<uint64_t>()((static_cast<uint64_t>(key.sequenceLength) << 32) | key.maxVowelCount) << 2);
+    }
+};
+
+/*
+Memoizes sequence counts in front of the Keyboard, keyed by the stable
+layout hash, the chess-piece name and the parameters. The cache holds at
+most capacity results and evicts the least recently used one; all the
+operations are thread-safe, and a missing result is computed outside of
+the lock. It can be saved to and loaded from a text file, one result per
+line, so that a restarted service starts warm.
+*/
+template<typename CountType = uint64_t>
+class SequenceCountCache
+{
+private:
+    using Entry = pair<SequenceCacheKey, CountType>;
+
+    const size_t capacity;
+    mutable std::mutex mutex;
+    /* Most recently used first */
+    std::list<Entry> entries;
+    unordered_map<SequenceCacheKey, typename std::list<Entry>::iterator, SequenceCacheKeyHash> index;
+
+    void InsertLocked(const SequenceCacheKey& key, const CountType& count)
+    {
+        auto found = index.find(key);
+        if (found != index.end())
+        {
+            found->second->second = count;
+            entries.splice(entries.begin(), entries, found->second);
+            return;
+        }
+
+        entries.emplace_front(key, count);
+        index[key] = entries.begin();
+        if (entries.size() > capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+public:
+    explicit SequenceCountCache(size_t newCapacity) : capacity(newCapacity)
+    {
+        if (0 == capacity)
+        {
+            throw invalid_argument("Cache capacity must be non-zero.");
+        }
+    }
+
+    static SequenceCacheKey MakeKey(const KeyboardLayout& keyboardLayout, const ChessPiece* chessPiecePtr,
+                                    unsigned int sequenceLength, unsigned int maxVowelCount)
+    {
+        return {keyboardLayout.GetHash(), chessPiecePtr->GetName(), sequenceLength, maxVowelCount};
+    }
+
+    /* Looks a result up, marking it as most recently used. */
+    bool Find(const SequenceCacheKey& key, CountType& count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found == index.end())
+        {
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, found->second);
+        count = found->second->second;
+        return true;
+    }
+
+    void Insert(const SequenceCacheKey& key, const CountType& count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        InsertLocked(key, count);
+    }
+
+    /* Returns the cached count, counting and caching it on a miss. */
+    CountType GetOrCount(const KeyboardLayout& keyboardLayout, const ChessPiece* chessPiecePtr,
+                         unsigned int sequenceLength, unsigned int maxVowelCount)
+    {
+        const SequenceCacheKey key = MakeKey(keyboardLayout, chessPiecePtr, sequenceLength, maxVowelCount);
+        CountType count(0);
+        if (Find(key, count))
+        {
+            return count;
+        }
+
+        Keyboard keyboard(sequenceLength, maxVowelCount, keyboardLayout, chessPiecePtr);
+        count = keyboard.CountSequences<CountType>();
+        Insert(key, count);
+        return count;
+    }
+
+    size_t GetSize() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    /* Writes the results, least recently used first, through a temporary file. */
+    void Save(const string& path) const
+    {
+        const string temporaryPath = path + ".tmp";
+        {
+            std::ofstream file(temporaryPath);
+            if (!file)
+            {
+                throw std::runtime_error("Unable to write cache file: " + temporaryPath);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry)
+            {
+                file << entry->first.layoutHash << ' ' << entry->first.pieceName << ' ' << entry->first.sequenceLength << ' '
+                     << entry->first.maxVowelCount << ' ' << ToString(entry->second) << '\n';
+            }
+
+            if (!file)
+            {
+                throw std::runtime_error("Unable to write cache file: " + temporaryPath);
+            }
+        }
+
+        if (0 != std::rename(temporaryPath.c_str(), path.c_str()))
+        {
+            throw std::runtime_error("Unable to replace cache file: " + path);
+        }
+    }
+
+    /* Adds the results of a saved cache file; a missing file leaves the cache cold. */
+    void Load(const string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            return;
+        }
+
+        string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream fields(line);
+            SequenceCacheKey key;
+            string count;
+            if (!(fields >> key.layoutHash >> key.pieceName >> key.sequenceLength >> key.maxVowelCount >> count))
+            {
+                throw std::runtime_error("Malformed cache file: " + path);
+            }
+
+            Insert(key, ParseCount<CountType>(count));
+        }
+    }
+};
+
+/*
+Packed binary file of the sequences of one Keyboard. All the integers are
+little-endian:
+
+    "KSEQ", version (u32), sequence length (u32), vowel limit (u32),
+    layout rows (u32), layout cols (u32), layout hash (u64),
+    chess-piece name (u32 size + bytes), key alphabet (u32 size + bytes),
+    bits per key (u32), sequence count (u64), payload
+
+Every key is stored as its index in the alphabet on ceil(log2(N)) bits,
+e.g. 5 bits for the 18 keys of the shipped layout, and the sequences are
+back to back in one LSB-first bit stream, followed by 8 zero bytes so a
+key can always be read with a single 64-bit load (on little-endian hosts).
+*/
+constexpr char SEQUENCE_FILE_MAGIC[4] = {'K', 'S', 'E', 'Q'};
+constexpr uint32_t SEQUENCE_FILE_VERSION = 1;
+constexpr size_t SEQUENCE_FILE_PADDING = 8;
+
+/* Writes the sequences streamed to it as a packed binary file, see SEQUENCE_FILE_MAGIC. */
+class PackedSequenceFileSink : public SequenceSink
+{
+private:
+    std::ofstream file;
+    const unsigned int sequenceLength;
+    unsigned int bitsPerKey = 1;
+    std::array<int, 256> keyIndices;
+    std::streampos countPosition;
+    uint64_t count = 0;
+    uint64_t bits = 0;
+    unsigned int bitCount = 0;
+    string buffer;
+    bool closed = false;
+
+    template<typename Integer>
+    void WriteInteger(Integer value)
+    {
+        for (size_t byte = 0; byte < sizeof(Integer); ++byte)
+        {
+            file.put(static_cast<char>((static_cast<uint64_t>(value) >> (byte * 8)) & 0xFF));
+        }
+    }
+
+    void WriteString(const string& value)
+    {
+        WriteInteger<uint32_t>(value.size());
+        file.write(value.data(), value.size());
+    }
+
+    void FlushBuffer()
+    {
+        file.write(buffer.data(), buffer.size());
+        buffer.clear();
+        if (!file)
+        {
+            throw std::runtime_error("Unable to write sequence file.");
+        }
+    }
+public:
+    PackedSequenceFileSink(const string& path, const Keyboard& keyboard)
+        : file(path, std::ios::binary), sequenceLength(keyboard.GetSequenceLength())
+    {
+        if (!file)
+        {
+            throw std::runtime_error("Unable to open sequence file: " + path);
+        }
+
+        const string alphabet = keyboard.GetKeyAlphabet();
+        keyIndices.fill(-1);
+        for (size_t index = 0; index < alphabet.size(); ++index)
+        {
+            keyIndices[static_cast<unsigned char>(alphabet[index])] = index;
+        }
+
+        while ((size_t(1) << bitsPerKey) < alphabet.size())
+        {
+            bitsPerKey++;
+        }
+
+        const KeyboardLayout& layout = keyboard.GetKeyboardLayout();
+        file.write(SEQUENCE_FILE_MAGIC, sizeof(SEQUENCE_FILE_MAGIC));
+        WriteInteger<uint32_t>(SEQUENCE_FILE_VERSION);
+        WriteInteger<uint32_t>(sequenceLength);
+        WriteInteger<uint32_t>(keyboard.GetMaxVowelCount());
+        WriteInteger<uint32_t>(layout.GetRows());
+        WriteInteger<uint32_t>(layout.GetCols());
+        WriteInteger<uint64_t>(layout.GetHash());
+        WriteString(keyboard.GetChessPiece()->GetName());
+        WriteString(alphabet);
+        WriteInteger<uint32_t>(bitsPerKey);
+        countPosition = file.tellp();
+        WriteInteger<uint64_t>(0);
+        if (!file)
+        {
+            throw std::runtime_error("Unable to write sequence file: " + path);
+        }
+    }
+
+    ~PackedSequenceFileSink()
+    {
+        try
+        {
+            Close();
+        }
+        catch (const exception& e)
+        {
+            cerr << "Exception while closing sequence file: " << e.what() << endl;
+        }
+    }
+
+    void Consume(std::string_view sequence) override
+    {
+        if (sequence.size() != sequenceLength)
+        {
+            throw invalid_argument("Sequence length does not match the sequence file.");
+        }
+
+        for (char key : sequence)
+        {
+            const int index = keyIndices[static_cast<unsigned char>(key)];
+            if (index < 0)
+            {
+                throw invalid_argument("Sequence key is not part of the layout.");
+            }
+
+            bits |= static_cast<uint64_t>(index) << bitCount;
+            bitCount += bitsPerKey;
+            while (bitCount >= 8)
+            {
+                buffer += static_cast<char>(bits & 0xFF);
+                bits >>= 8;
+                bitCount -= 8;
+            }
+        }
+
+        count++;
+        if (buffer.size() >= (1 << 16))
+        {
+            FlushBuffer();
+        }
+    }
+
+    uint64_t GetCount() const
+    {
+        return count;
+    }
+
+    /* Writes the last bits, the padding and the sequence count; the sink takes no sequence after that. */
+    void Close()
+    {
+        if (closed)
+        {
+            return;
+        }
+
+        closed = true;
+        if (bitCount > 0)
+        {
+            buffer += static_cast<char>(bits & 0xFF);
+        }
+        buffer.append(SEQUENCE_FILE_PADDING, '\0');
+        FlushBuffer();
+
+        file.seekp(countPosition);
+        WriteInteger<uint64_t>(count);
+        file.close();
+        if (!file)
+        {
+            throw std::runtime_error("Unable to write sequence file.");
+        }
+    }
+};
+
+/*
+Read-only view of a packed sequence file. The file is memory-mapped where
+available, or else read into memory once, and the keys are decoded
+straight from the mapped bit stream, so opening a file costs the header
+only and any sequence can be read in O(sequence length).
+*/
+class PackedSequenceFile
+{
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    void* mapping = nullptr;
+#endif
+    vector<unsigned char> contents;
+
+    unsigned int sequenceLength = 0;
+    unsigned int maxVowelCount = 0;
+    unsigned int rows = 0;
+    unsigned int cols = 0;
+    uint64_t layoutHash = 0;
+    string pieceName;
+    string alphabet;
+    unsigned int bitsPerKey = 0;
+    uint64_t count = 0;
+    const unsigned char* payload = nullptr;
+
+    template<typename Integer>
+    Integer ReadInteger(size_t& offset) const
+    {
+        if (offset + sizeof(Integer) > size)
+        {
+            throw std::runtime_error("Truncated sequence file.");
+        }
+
+        uint64_t value = 0;
+        for (size_t byte = 0; byte < sizeof(Integer); ++byte)
+        {
+            value |= static_cast<uint64_t>(data[offset + byte]) << (byte * 8);
+        }
+
+        offset += sizeof(Integer);
+        return static_cast<Integer>(value);
+    }
+
+    string ReadString(size_t& offset) const
+    {
+        const uint32_t length = ReadInteger<uint32_t>(offset);
+        if (offset + length > size)
+        {
+            throw std::runtime_error("Truncated sequence file.");
+        }
+
+        string value(reinterpret_cast<const char*>(data + offset), length);
+        offset += length;
+        return value;
+    }
+
+    void Map(const string& path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+        {
+            throw std::runtime_error("Unable to open sequence file: " + path);
+        }
+
+        struct stat status;
+        if ((0 != fstat(descriptor, &status)) || (status.st_size <= 0))
+        {
+            close(descriptor);
+            throw std::runtime_error("Unable to read sequence file: " + path);
+        }
+
+        size = status.st_size;
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        close(descriptor);
+        if (MAP_FAILED == mapping)
+        {
+            mapping = nullptr;
+            throw std::runtime_error("Unable to map sequence file: " + path);
+        }
+
+        data = static_cast<const unsigned char*>(mapping);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Unable to open sequence file: " + path);
+        }
+
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = contents.data();
+        size = contents.size();
+#endif
+    }
+
+    void Unmap()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (nullptr != mapping)
+        {
+            munmap(mapping, size);
+            mapping = nullptr;
+        }
+#endif
+    }
+public:
+    explicit PackedSequenceFile(const string& path)
+    {
+        Map(path);
+        try
+        {
+            if ((size < sizeof(SEQUENCE_FILE_MAGIC)) || !std::equal(SEQUENCE_FILE_MAGIC, SEQUENCE_FILE_MAGIC + sizeof(SEQUENCE_FILE_MAGIC), data))
+            {
+                throw std::runtime_error("Not a sequence file: " + path);
+            }
+
+            size_t offset = sizeof(SEQUENCE_FILE_MAGIC);
+            if (ReadInteger<uint32_t>(offset) != SEQUENCE_FILE_VERSION)
+            {
+                throw std::runtime_error("Unsupported sequence file version: " + path);
+            }
+
+            sequenceLength = ReadInteger<uint32_t>(offset);
+            maxVowelCount = ReadInteger<uint32_t>(offset);
+            rows = ReadInteger<uint32_t>(offset);
+            cols = ReadInteger<uint32_t>(offset);
+            layoutHash = ReadInteger<uint64_t>(offset);
+            pieceName = ReadString(offset);
+            alphabet = ReadString(offset);
+            bitsPerKey = ReadInteger<uint32_t>(offset);
+            count = ReadInteger<uint64_t>(offset);
+
+            if ((0 == sequenceLength) || (bitsPerKey < 1) || (bitsPerKey > 8) || alphabet.empty() || ((size_t(1) << bitsPerKey) < alphabet.size()) ||
+                (offset + SEQUENCE_FILE_PADDING > size))
+            {
+                throw std::runtime_error("Malformed sequence file: " + path);
+            }
+
+            /* Checked by division, as count * sequenceLength * bitsPerKey may overflow */
+            const uint64_t payloadBits = static_cast<uint64_t>(size - offset - SEQUENCE_FILE_PADDING) * 8;
+            if (count > payloadBits / (static_cast<uint64_t>(sequenceLength) * bitsPerKey))
+            {
+                throw std::runtime_error("Malformed sequence file: " + path);
+            }
+
+            payload = data + offset;
+        }
+        catch (...)
+        {
+            Unmap();
+            throw;
+        }
+    }
+
+    PackedSequenceFile(const PackedSequenceFile&) = delete;
+    PackedSequenceFile& operator=(const PackedSequenceFile&) = delete;
+
+    ~PackedSequenceFile()
+    {
+        Unmap();
+    }
+
+    uint64_t GetCount() const { return count; }
+    unsigned int GetSequenceLength() const { return sequenceLength; }
+    unsigned int GetMaxVowelCount() const { return maxVowelCount; }
+    unsigned int GetRows() const { return rows; }
+    unsigned int GetCols() const { return cols; }
+    uint64_t GetLayoutHash() const { return layoutHash; }
+    const string& GetPieceName() const { return pieceName; }
+    const string& GetAlphabet() const { return alphabet; }
+    unsigned int GetBitsPerKey() const { return bitsPerKey; }
+
+    /* Returns the alphabet index of the key at a position of a sequence. */
+    unsigned int GetKeyIndex(uint64_t sequence, unsigned int position) const
+    {
+        const uint64_t bit = (sequence * sequenceLength + position) * bitsPerKey;
+        uint64_t word = 0;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        std::memcpy(&word, payload + bit / 8, sizeof(word));
+#else
+        for (size_t byte = 0; byte < 8; ++byte)
+        {
+            word |= static_cast<uint64_t>(payload[bit / 8 + byte]) << (byte * 8);
+        }
+#endif
+
+        return (word >> (bit % 8)) & ((1u << bitsPerKey) - 1);
+    }
+
+    /* Decodes a sequence into the buffer and returns a view of it. */
+    std::string_view GetSequence(uint64_t sequence, string& buffer) const
+    {
+        if (sequence >= count)
+        {
+            throw std::out_of_range("Sequence index is out of range.");
+        }
+
+        buffer.resize(sequenceLength);
+        for (unsigned int position = 0; position < sequenceLength; ++position)
+        {
+            const unsigned int keyIndex = GetKeyIndex(sequence, position);
+            if (keyIndex >= alphabet.size())
+            {
+                throw std::runtime_error("Malformed sequence file: key index out of the alphabet.");
+            }
+            buffer[position] = alphabet[keyIndex];
+        }
+
+        return buffer;
+    }
+
+    /* Streams every sequence of the file to the sink. */
+    void Stream(SequenceSink& sink) const
+    {
+        string buffer;
+        for (uint64_t sequence = 0; sequence < count; ++sequence)
+        {
+            sink.Consume(GetSequence(sequence, buffer));
+        }
+    }
+};
+
+/*
+Benchmark suite of the sequence engines, run with --benchmark. Every
+engine is timed over a sweep of sequence lengths, vowel limits, layout
+sizes and thread counts, each case being repeated until it has run for
+at least MIN_SECONDS. Every run is checked against the DP count, so a
+wrong engine fails the benchmark instead of reporting a fast time.
+
+Each case reports the time per run and per sequence, the heap allocations per run
+(only when compiled with -DCHESS_CHALLENGE_COUNT_ALLOCATIONS) and the
+peak resident set size of the case. The enumerating engines
+are skipped past MAX_ENUMERATED_SEQUENCES, the matrix power past
+MAX_MATRIX_STATES states and the bitboards on layouts above 64 cells.
+*/
+class KeyboardBenchmark
+{
+private:
+    static constexpr double MIN_SECONDS = 0.1;
+    static constexpr uint64_t MAX_ENUMERATED_SEQUENCES = 2000000;
+    static constexpr size_t MAX_MATRIX_STATES = 2048;
+
+    std::ostream& out;
+
+    static uint64_t GetAllocationCount()
+    {
+#if defined(CHESS_CHALLENGE_COUNT_ALLOCATIONS)
+        return allocationCount.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
+    }
+
+    /* Returns the peak resident set size of the process in KB, or -1 if unknown. */
+    static long GetPeakResidentSetKb()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        rusage usage;
+        if (0 != getrusage(RUSAGE_SELF, &usage))
+        {
+            return -1;
+        }
+#if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#else
+        return -1;
+#endif
+    }
+
+    /*
+    Resets the peak resident set size of the process, which Linux supports
+    through /proc/self/clear_refs, so that it covers a single case.
+    */
+    static bool ResetPeakResidentSet()
+    {
+        std::ofstream clearRefs("/proc/self/clear_refs");
+        return static_cast<bool>(clearRefs << "5" << std::flush);
+    }
+
+    /* Returns the peak resident set size since the last reset in KB, or -1 if unknown. */
+    static long GetResetPeakResidentSetKb()
+    {
+        std::ifstream status("/proc/self/status");
+        string field;
+        while (status >> field)
+        {
+            long value = 0;
+            if (("VmHWM:" == field) && (status >> value))
+            {
+                return value;
+            }
+        }
+
+        return -1;
+    }
+
+    /* The shipped layout for 4x5, otherwise a full layout of letters and digits. */
+    static CharVector2D MakeLayout(int rows, int cols)
+    {
+        const string KEYS = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        CharVector2D layout(rows, vector<char>(cols));
+        for (int i = 0; i < rows; ++i)
+        {
+            for (int j = 0; j < cols; ++j)
+            {
+                bool shipped = (rows == static_cast<int>(DEFAULT_LAYOUT.size())) && (cols == static_cast<int>(DEFAULT_LAYOUT[0].size()));
+                layout[i][j] = shipped ? DEFAULT_LAYOUT[i][j] : KEYS[(i * cols + j) % KEYS.size()];
+            }
+        }
+
+        return layout;
+    }
+
+    /* Times one case, failing if a run does not find the expected number of sequences. */
+    template<typename RunFunction>
+    void Measure(const string& name, uint64_t sequences, RunFunction run)
+    {
+        /* The peak RSS of the case where it can be reset, otherwise the growth of the process peak */
+        const bool peakReset = ResetPeakResidentSet();
+        const long peakBefore = peakReset ? 0 : GetPeakResidentSetKb();
+        const uint64_t allocationsBefore = GetAllocationCount();
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t iterations = 0;
+        double seconds = 0;
+        do
+        {
+            if (run() != sequences)
+            {
+                throw std::runtime_error("Benchmark " + name + " counted a wrong number of sequences.");
+            }
+
+            iterations++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        while (seconds < MIN_SECONDS);
+
+        char allocations[32] = "n/a";
+#if defined(CHESS_CHALLENGE_COUNT_ALLOCATIONS)
+        std::snprintf(allocations, sizeof(allocations), "%llu", static_cast<unsigned long long>((GetAllocationCount() - allocationsBefore) / iterations));
+#else
+        (void)allocationsBefore;
+#endif
+
+        const long peak = peakReset ? GetResetPeakResidentSetKb() : GetPeakResidentSetKb();
+        const long caseResidentSetKb = ((peak < 0) || (peakBefore < 0)) ? -1 : peak - peakBefore;
+
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-60s %14.0f %14.4g %10llu %14s %14ld", name.c_str(), seconds * 1e9 / iterations,
+                      seconds * 1e9 / iterations / std::max<uint64_t>(sequences, 1),
+                      static_cast<unsigned long long>(iterations), allocations, caseResidentSetKb);
+        out << line << endl;
+    }
+public:
+    explicit KeyboardBenchmark(std::ostream& newOut) : out(newOut) {}
+
+    void Run()
+    {
+        const vector<Coordinates> LAYOUT_SIZES = {{4, 5}, {8, 8}, {16, 16}};
+        const vector<unsigned int> SEQUENCE_LENGTHS = {4, 7, 10};
+        const vector<unsigned int> VOWEL_LIMITS = {0, 2};
+        vector<unsigned int> threadCounts = {1};
+        if (std::thread::hardware_concurrency() > 1)
+        {
+            threadCounts.push_back(std::thread::hardware_concurrency());
+        }
+
+        char header[256];
+        std::snprintf(header, sizeof(header), "%-60s %14s %14s %10s %14s %14s", "Benchmark", "ns/run", "ns/sequence", "iterations", "allocs/run", "case RSS (KB)");
+        out << header << endl;
+
+        Knight knight;
+        for (const auto& [rows, cols] : LAYOUT_SIZES)
+        {
+            const KeyboardLayout layout(DEFAULT_INVALID_KEY, MakeLayout(rows, cols));
+            for (unsigned int length : SEQUENCE_LENGTHS)
+            {
+                for (unsigned int vowels : VOWEL_LIMITS)
+                {
+                    Keyboard keyboard(length, vowels, layout, &knight);
+                    const uint64_t sequences = keyboard.CountSequencesByDynamicProgramming<uint64_t>();
+                    const size_t states = keyboard.keyMoves.GetKeyCount() * (vowels + 1);
+                    const bool enumerable = sequences <= MAX_ENUMERATED_SEQUENCES;
+
+                    for (unsigned int threads : threadCounts)
+                    {
+                        keyboard.SetThreadCount(threads);
+                        const string suffix = "/" + std::to_string(rows) + "x" + std::to_string(cols) + "/length:" + std::to_string(length) +
+                                              "/vowels:" + std::to_string(vowels) + "/threads:" + std::to_string(threads);
+                        auto countMode = [&keyboard](CountingMode mode)
+                        {
+                            return [&keyboard, mode]() { return keyboard.CountSequences(mode); };
+                        };
+
+                        if (1 == threads)
+                        {
+                            if (enumerable)
+                            {
+                                Measure("BFS" + suffix, sequences, [&keyboard]()
+                                {
+                                    uint64_t count = 0;
+                                    for (const auto& [key, keySequences] : keyboard.GenerateSequences())
+                                    {
+                                        count += keySequences.size();
+                                    }
+                                    return count;
+                                });
+                                Measure("DepthFirst" + suffix, sequences, countMode(CountingMode::DepthFirst));
+                            }
+
+                            Measure("DynamicProgramming" + suffix, sequences, [&keyboard]() { return keyboard.CountSequencesByDynamicProgramming<uint64_t>(); });
+                            if (states <= MAX_MATRIX_STATES)
+                            {
+                                Measure("MatrixPower" + suffix, sequences, countMode(CountingMode::MatrixPower));
+                            }
+
+                            if (layout.FitsInBitboard())
+                            {
+                                Measure("Bitboard" + suffix, sequences, countMode(CountingMode::Bitboard));
+                            }
+
+                            Measure("Offload" + suffix, sequences, countMode(CountingMode::Offload));
+                        }
+
+                        if (enumerable)
+                        {
+                            Measure("ParallelEnumerate" + suffix, sequences, countMode(CountingMode::ParallelEnumerate));
+                            Measure("WorkStealingEnumerate" + suffix, sequences, countMode(CountingMode::WorkStealingEnumerate));
+                        }
+
+                        Measure("SparseMatrix" + suffix, sequences, countMode(CountingMode::SparseMatrix));
+                    }
+                }
+            }
+        }
+
+        /*
+        A pad of one consonant is symmetric and large enough for the orbit
+        reduction and for DynamicProgramming to run on the sparse engine, so
+        both are checked against the batched counter on the unreduced table.
+        */
+        const int PAD_SIZE = 200;
+        const KeyboardLayout pad(DEFAULT_INVALID_KEY, CharVector2D(PAD_SIZE, vector<char>(PAD_SIZE, 'B')));
+        Keyboard padKeyboard(SYMMETRY_MIN_LENGTH, 0, pad, &knight);
+        const uint64_t padSequences = padKeyboard.CountSequences(CountingMode::Offload);
+        const string padSuffix = "/symmetric " + std::to_string(PAD_SIZE) + "x" + std::to_string(PAD_SIZE) + "/length:" +
+                                 std::to_string(SYMMETRY_MIN_LENGTH) + "/vowels:0/threads:" + std::to_string(threadCounts.back());
+        padKeyboard.SetThreadCount(threadCounts.back());
+        Measure("DynamicProgramming" + padSuffix, padSequences, [&padKeyboard]() { return padKeyboard.CountSequences(CountingMode::DynamicProgramming); });
+        Measure("SparseMatrix" + padSuffix, padSequences, [&padKeyboard]() { return padKeyboard.CountSequences(CountingMode::SparseMatrix); });
+    }
+};
+
+/*
+Answers queries read line by line, one answer line per query in request
+order, "ok <result>" or "error <message>":
+
+    count <layout> <piece> <length> <max vowels> [<start key> <end key>]
+    unrank <layout> <piece> <length> <max vowels> <rank>
+    breakdown <layout> <piece> <length> <max vowels>
+    quit
+
+The move tables of every layout and piece are built before the workers
+start and only read afterwards, so the fixed pool of workers shares them
+without locks. Counts are exact BigCounts. The vowel limit of a query is
+clamped to what a sequence can reach, and a query may take at most
+MAX_QUERY_STATES keys x length x (vowel limit + 1) states, so that no
+single query holds a worker for long. The unrank completion tables are
+kept, for the MAX_RANKERS most recently used queries.
+*/
+class SequenceServer
+{
+private:
+    static constexpr unsigned int MAX_SEQUENCE_LENGTH = 4096;
+    static constexpr uint64_t MAX_QUERY_STATES = 1 << 18;
+    static constexpr size_t MAX_RANKERS = 64;
+    /* Queries read ahead of the oldest unanswered one */
+    static constexpr size_t MAX_PENDING_QUERIES = 1024;
+
+    /* Ranks are 64-bit, so the completion counts can saturate, see SaturatingCount */
+    using Ranker = SequenceRanker<SaturatingCount>;
+    using RankerEntry = pair<string, std::shared_ptr<const Ranker>>;
+
+    struct Query
+    {
+        string line;
+        std::promise<string> answer;
+    };
+
+    std::istream& in;
+    std::ostream& out;
+    const unsigned int workerCount;
+    vector<std::unique_ptr<ChessPiece>> chessPieces;
+    /* Keyed by "<layout> <piece>", read-only once the server runs */
+    unordered_map<string, std::unique_ptr<SequenceQueryEngine>> engines;
+
+    /* Most recently used first, shared with the queries still using an evicted one */
+    mutable std::mutex rankersMutex;
+    mutable std::list<RankerEntry> rankers;
+    mutable unordered_map<string, std::list<RankerEntry>::iterator> rankerIndex;
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<Query> queries;
+    std::deque<std::future<string>> answers;
+    bool closed = false;
+
+    static string ToLower(string name)
+    {
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return name;
+    }
+
+    static KeyCode ParseKey(const string& key)
+    {
+        if (1 != key.size())
+        {
+            throw invalid_argument("Keys must be single chars: " + key);
+        }
+
+        return static_cast<unsigned char>(key[0]);
+    }
+
+    /* Returns the ranker of a query, building it outside of the lock on a miss. */
+    std::shared_ptr<const Ranker> GetRanker(const string& name, const KeyMoveTable& table, unsigned int sequenceLength, unsigned int maxVowelCount) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(rankersMutex);
+            auto found = rankerIndex.find(name);
+            if (found != rankerIndex.end())
+            {
+                rankers.splice(rankers.begin(), rankers, found->second);
+                return found->second->second;
+            }
+        }
+
+        auto ranker = std::make_shared<const Ranker>(table, sequenceLength, maxVowelCount);
+        std::lock_guard<std::mutex> lock(rankersMutex);
+        if (rankerIndex.count(name))
+        {
+            return rankerIndex[name]->second;
+        }
+
+        rankers.emplace_front(name, ranker);
+        rankerIndex[name] = rankers.begin();
+        if (rankers.size() > MAX_RANKERS)
+        {
+            rankerIndex.erase(rankers.back().first);
+            rankers.pop_back();
+        }
+
+        return ranker;
+    }
+
+    string Answer(const string& line) const
+    {
+        std::istringstream request(line);
+        string command, layoutName, pieceName;
+        unsigned int sequenceLength = 0;
+        unsigned int maxVowelCount = 0;
+        if (!(request >> command >> layoutName >> pieceName >> sequenceLength >> maxVowelCount))
+        {
+            throw invalid_argument("Malformed query, expected <command> <layout> <piece> <length> <max vowels>.");
+        }
+
+        if ((0 == sequenceLength) || (sequenceLength > MAX_SEQUENCE_LENGTH))
+        {
+            throw invalid_argument("Sequence length is out of range.");
+        }
+
+        const string engineName = layoutName + ' ' + ToLower(pieceName);
+        const auto engine = engines.find(engineName);
+        if (engine == engines.end())
+        {
+            throw invalid_argument("Unknown layout or piece: " + layoutName + ' ' + pieceName);
+        }
+
+        /* A larger vowel limit than the sequence can reach gives the same answers */
+        const SequenceQueryEngine& queryEngine = *engine->second;
+        const KeyMoveTable& table = queryEngine.GetMoveTable();
+        const bool hasVowels = std::any_of(table.vowels.begin(), table.vowels.end(), [](unsigned int vowel) { return 0 != vowel; });
+        maxVowelCount = hasVowels ? std::min(maxVowelCount, sequenceLength) : 0;
+        if (static_cast<uint64_t>(table.GetKeyCount()) * sequenceLength * (maxVowelCount + 1) > MAX_QUERY_STATES)
+        {
+            throw invalid_argument("Query is too large, at most " + std::to_string(MAX_QUERY_STATES) + " keys x length x (vowel limit + 1) states.");
+        }
+
+        string answer;
+        if ("count" == command)
+        {
+            string startKey, endKey;
+            if (request >> startKey >> endKey)
+            {
+                answer = ToString(queryEngine.CountSequencesBetween<BigCount>(ParseKey(startKey), ParseKey(endKey), sequenceLength, maxVowelCount));
+            }
+            else
+            {
+                answer = ToString(queryEngine.CountSequences<BigCount>(vector<SequenceQuery>{{sequenceLength, maxVowelCount}})[0]);
+            }
+        }
+        else if ("unrank" == command)
+        {
+            uint64_t rank = 0;
+            if (!(request >> rank))
+            {
+                throw invalid_argument("Malformed query, expected a rank.");
+            }
+
+            const string rankerName = engineName + ' ' + std::to_string(sequenceLength) + ' ' + std::to_string(maxVowelCount);
+            answer = GetRanker(rankerName, table, sequenceLength, maxVowelCount)->Unrank(SaturatingCount(rank));
+        }
+        else if ("breakdown" == command)
+        {
+            const vector<BigCount> counts = queryEngine.CountSequencesByStartKey<BigCount>({sequenceLength, maxVowelCount});
+            for (int key = 0; key < table.GetKeyCount(); ++key)
+            {
+                answer += (key > 0) ? " " : "";
+                answer += table.keyChars.empty() ? std::to_string(table.keys[key]) : string(1, table.keyChars[key]);
+                answer += ':' + ToString(counts[key]);
+            }
+        }
+        else
+        {
+            throw invalid_argument("Unknown command: " + command);
+        }
+
+        return answer;
+    }
+
+    void Work()
+    {
+        while (true)
+        {
+            Query query;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this]() { return closed || !queries.empty(); });
+                if (queries.empty())
+                {
+                    return;
+                }
+
+                query = std::move(queries.front());
+                queries.pop_front();
+            }
+
+            try
+            {
+                query.answer.set_value("ok " + Answer(query.line));
+            }
+            catch (const exception& e)
+            {
+                query.answer.set_value(string("error ") + e.what());
+            }
+        }
+    }
+
+    /* Writes the answers in request order, as each becomes ready */
+    void Write()
+    {
+        while (true)
+        {
+            std::future<string> answer;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this]() { return closed || !answers.empty(); });
+                if (answers.empty())
+                {
+                    return;
+                }
+
+                answer = std::move(answers.front());
+                answers.pop_front();
+            }
+            queueChanged.notify_all();
+
+            out << answer.get() << endl;
+        }
+    }
+public:
+    SequenceServer(std::istream& newIn, std::ostream& newOut, const vector<pair<string, KeyboardLayout>>& keyboardLayouts,
+                   unsigned int newWorkerCount = std::max(1u, std::thread::hardware_concurrency()))
+        : in(newIn), out(newOut), workerCount(std::max(1u, newWorkerCount))
+    {
+        chessPieces.push_back(std::make_unique<Knight>());
+        chessPieces.push_back(std::make_unique<King>());
+        chessPieces.push_back(std::make_unique<Bishop>());
+        chessPieces.push_back(std::make_unique<Rook>());
+        chessPieces.push_back(std::make_unique<Queen>());
+
+        for (const auto& [layoutName, keyboardLayout] : keyboardLayouts)
+        {
+            for (const auto& chessPiece : chessPieces)
+            {
+                engines[layoutName + ' ' + ToLower(chessPiece->GetName())] = std::make_unique<SequenceQueryEngine>(keyboardLayout, chessPiece.get());
+            }
+        }
+    }
+
+    /* Serves the queries until the input ends or a quit. */
+    void Run()
+    {
+        vector<std::thread> workers;
+        for (unsigned int i = 0; i < workerCount; ++i)
+        {
+            workers.emplace_back(&SequenceServer::Work, this);
+        }
+        std::thread writer(&SequenceServer::Write, this);
+
+        string line;
+        while (std::getline(in, line))
+        {
+            if (line.empty() || ('#' == line[0]))
+            {
+                continue;
+            }
+            if ("quit" == line)
+            {
+                break;
+            }
+
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this]() { return answers.size() < MAX_PENDING_QUERIES; });
+            queries.push_back(Query{line, {}});
+            answers.push_back(queries.back().answer.get_future());
+            lock.unlock();
+            queueChanged.notify_all();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            closed = true;
+        }
+        queueChanged.notify_all();
+
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        writer.join();
+    }
+};
+
+/* Parses a shard spec "i/n", selecting shard i (from 0) of n. */
+pair<unsigned int, unsigned int> ParseShardSpec(const string& spec)
+{
+    const size_t slash = spec.find('/');
+    const bool digits = (slash != string::npos) && (slash > 0) && (slash + 1 < spec.size()) &&
+                        std::all_of(spec.begin(), spec.end(), [](char c) { return ('/' == c) || ((c >= '0') && (c <= '9')); });
+    if (!digits)
+    {
+        throw invalid_argument("Shard spec must be of the form i/n: " + spec);
+    }
+
+    const unsigned long shard = std::stoul(spec.substr(0, slash));
+    const unsigned long shardCount = std::stoul(spec.substr(slash + 1));
+    if ((shardCount == 0) || (shard >= shardCount) || (shardCount > UINT32_MAX))
+    {
+        throw invalid_argument("Shard spec must satisfy 0 <= i < n: " + spec);
+    }
+
+    return {static_cast<unsigned int>(shard), static_cast<unsigned int>(shardCount)};
+}
+
+int main(int argc, char* argv[]) 
+{
+    const char invalidKey = DEFAULT_INVALID_KEY;
+    CharVector2D layout;
+    for (const auto& row : DEFAULT_LAYOUT)
+    {
+        layout.emplace_back(row.begin(), row.end());
+    }
+
+    const unordered_map<string, CountingMode> MODES = {
+        {"enumerate", CountingMode::Enumerate},
+        {"depth-first", CountingMode::DepthFirst},
+        {"parallel", CountingMode::ParallelEnumerate},
+        {"work-stealing", CountingMode::WorkStealingEnumerate},
+        {"dp", CountingMode::DynamicProgramming},
+        {"matrix-power", CountingMode::MatrixPower},
+        {"bitboard", CountingMode::Bitboard},
+        {"sparse", CountingMode::SparseMatrix},
+        {"offload", CountingMode::Offload}
+    };
+
+    try
+    {
+        CountingMode mode = CountingMode::DynamicProgramming;
+        string statsFormat;
+        string shardSpec;
+        string outputPath;
+        for (int i = 1; i < argc; ++i)
+        {
+            const string argument = argv[i];
+            if ("--benchmark" == argument)
+            {
+                KeyboardBenchmark(cout).Run();
+                return EXIT_SUCCESS;
+            }
+            else if ("--serve" == argument)
+            {
+                const CharVector2D PHONE_LAYOUT = {
+                    {'1', '2', '3'},
+                    {'4', '5', '6'},
+                    {'7', '8', '9'},
+                    {invalidKey, '0', invalidKey}
+                };
+
+                SequenceServer(std::cin, cout, {{"default", KeyboardLayout(invalidKey, layout)}, {"phone", KeyboardLayout(invalidKey, PHONE_LAYOUT)}}).Run();
+                return EXIT_SUCCESS;
+            }
+            else if (("--mode" == argument) && (i + 1 < argc) && MODES.count(argv[i + 1]))
+            {
+                mode = MODES.at(argv[++i]);
+            }
+            else if (("--stats" == argument) && (i + 1 < argc) && ((string(argv[i + 1]) == "json") || (string(argv[i + 1]) == "prometheus")))
+            {
+                statsFormat = argv[++i];
+            }
+            else if (("--shard" == argument) && (i + 1 < argc))
+            {
+                shardSpec = argv[++i];
+            }
+            else if (("--output" == argument) && (i + 1 < argc))
+            {
+                outputPath = argv[++i];
+            }
+            else
+            {
+                cerr << "Usage: " << argv[0] << " [--benchmark] [--serve] [--mode <enumerate|depth-first|parallel|work-stealing|dp|matrix-power|bitboard|sparse|offload>]"
+                     << " [--stats <json|prometheus>] [--shard <i/n> [--output <packed file>]]" << endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        KeyboardLayout keyboardLayout(invalidKey, layout);
+        Knight knight;
+        Keyboard keyboard(DEFAULT_SEQUENCE_LENGTH, DEFAULT_MAX_VOWEL_COUNT, keyboardLayout, &knight);
+    
+        if (!shardSpec.empty())
+        {
+            /* Streams one shard of the ranked sequences, as text to stdout or as a packed file */
+            const auto [shard, shardCount] = ParseShardSpec(shardSpec);
+            const auto [first, last] = keyboard.GetShardRange(shard, shardCount);
+            if (outputPath.empty())
+            {
+                StreamSequenceSink sink(cout);
+                keyboard.EnumerateSequenceRange(first, last, sink);
+            }
+            else
+            {
+                PackedSequenceFileSink sink(outputPath, keyboard);
+                keyboard.EnumerateSequenceRange(first, last, sink);
+                sink.Close();
+            }
+
+            cerr << "Shard " << shardSpec << ": sequences [" << first << ", " << last << ")" << endl;
+        }
+        else
+        {
+            keyboard.displayTotalSequences(mode);
+        }
+
+        /* The counters are only filled when compiled with -DCHESS_CHALLENGE_STATS */
+        if ("json" == statsFormat)
+        {
+            cout << keyboard.GetStats().ToJson() << endl;
+        }
+        else if ("prometheus" == statsFormat)
+        {
+            cout << keyboard.GetStats().ToPrometheus();
+        }
     }
     catch (const exception& e) 
     {
-        cerr << "Program execution failed. Terminating..." << endl;
+        cerr << "Program execution failed: " << e.what() << ". Terminating..." << endl;
         return EXIT_FAILURE;
     }
 